@@ -30,13 +30,18 @@
 #include "http_log.h"
 #include "http_request.h"
 #include "apr_version.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
 #include "apr_ldap.h"
 #include "apr_reslist.h"
 #include "apr_strings.h"
 #include "apr_tables.h"
+#include "apr_thread_proc.h"
 #include "util_ldap.h"
 #include "util_script.h"
 
+#include "vhost_ldap_cache.h"
+
 #if !defined(APU_HAS_LDAP) && !defined(APR_HAS_LDAP)
 #error mod_vhost_ldap requires APR-util to have LDAP support built in
 #endif
@@ -58,6 +63,12 @@
 
 #define MAX_FAILURES 5
 
+#define DEFAULT_CACHE_TTL 60
+
+#define DEFAULT_WARMUP_CONCURRENCY 4
+#define DEFAULT_WARMUP_JITTER 10
+#define WARMUP_LOG_TAIL (1024 * 1024)	/* Bytes of an access log read for warmup */
+
 module AP_MODULE_DECLARE_DATA vhost_ldap_module;
 
 typedef enum {
@@ -89,8 +100,26 @@ typedef struct mod_vhost_ldap_config_t {
 
     int wildcard;                       /* Do wildcard search if host not found */
 
+    apr_array_header_t *exports;        /* Extra attributes exported to the request */
+
+    int cache_entries;                  /* Size of the vhost cache (0 = disabled) */
+    int cache_ttl;                      /* Seconds a cached vhost stays valid */
+    mod_vhost_ldap_cache_t *cache;      /* The cache itself, created in child_init, shared by servers with the same settings */
+
+    char *warmup_file;                  /* Hostname list or access log to warm the cache from */
+    int warmup_accesslog;               /* Set if warmup_file is an access log */
+    int warmup_concurrency;             /* Maximum number of parallel warmup searches */
+    int warmup_jitter;                  /* Maximum random delay before warmup starts */
+    apr_array_header_t *warmup_hosts;   /* Hostnames to warm and their counts, loaded in post_config */
+
 } mod_vhost_ldap_config_t;
 
+typedef struct mod_vhost_ldap_export_t {
+    const char *attribute;		/* LDAP attribute to fetch */
+    const char *variable;		/* Environment variable and note to set */
+    int index;				/* Position in search_attributes (set in post_config) */
+} mod_vhost_ldap_export_t;
+
 typedef struct mod_vhost_ldap_request_t {
     char *dn;				/* The saved dn from a successful search */
     char *name;				/* ServerName */
@@ -99,11 +128,29 @@ typedef struct mod_vhost_ldap_request_t {
     char *cgiroot;			/* ScriptAlias */
     char *uid;				/* Suexec Uid */
     char *gid;				/* Suexec Gid */
+
+    /* Per request statistics, exported as vhost-ldap-* notes */
+    apr_interval_time_t connect_time;	/* Time spent getting a connection from mod_ldap's pool */
+    apr_interval_time_t search_time;	/* Time spent searching, including a (re)bind if needed */
+    apr_interval_time_t retry_time;	/* Time spent sleeping between retries */
+    apr_interval_time_t docroot_time;	/* Time spent resolving DocumentRoot */
+    int searches;			/* Number of LDAP searches */
+    int retries;			/* Number of retries after server failure */
+    int wildcard;			/* Number of wildcard levels tried */
+    int fallback;			/* Set if the fallback vhost was used */
+    const char *cache;			/* "hit" or "miss" if the vhost cache is enabled */
 } mod_vhost_ldap_request_t;
 
 char *attributes[] =
   { "apacheServerName", "apacheDocumentRoot", "apacheScriptAlias", "apacheSuexecUid", "apacheSuexecGid", "apacheServerAdmin", 0 };
 
+/*
+ * attributes[] followed by every VhostLDAPExportAttribute of every server,
+ * built once in post_config.  All servers search with the same list so the
+ * values cached by mod_ldap always line up with the indexes we use.
+ */
+static char **search_attributes = attributes;
+
 static int total_modules;
 
 #if (APR_MAJOR_VERSION >= 1)
@@ -127,9 +174,176 @@ static void ImportULDAPOptFn(void)
 }
 #endif 
 
+/*
+ * Build search_attributes and resolve the index of each exported attribute,
+ * so translate_name only has to walk a precompiled table.
+ */
+static void mod_vhost_ldap_compile_exports(apr_pool_t *p, server_rec *s)
+{
+    apr_array_header_t *attrs = apr_array_make(p, 16, sizeof(char *));
+    char **a;
+    int i, j;
+
+    for (a = attributes; *a; a++) {
+	*(char **)apr_array_push(attrs) = *a;
+    }
+
+    for (; s; s = s->next) {
+	mod_vhost_ldap_config_t *conf =
+	    (mod_vhost_ldap_config_t *)ap_get_module_config(s->module_config, &vhost_ldap_module);
+	mod_vhost_ldap_export_t *exports;
+
+	if (conf->exports == NULL)
+	    continue;
+
+	exports = (mod_vhost_ldap_export_t *)conf->exports->elts;
+	for (i = 0; i < conf->exports->nelts; i++) {
+	    for (j = 0; j < attrs->nelts; j++) {
+		if (strcasecmp(((char **)attrs->elts)[j], exports[i].attribute) == 0)
+		    break;
+	    }
+	    if (j == attrs->nelts) {
+		*(char **)apr_array_push(attrs) = (char *)exports[i].attribute;
+	    }
+	    exports[i].index = j;
+	}
+    }
+
+    *(char **)apr_array_push(attrs) = NULL;
+    search_attributes = (char **)attrs->elts;
+}
+
+typedef struct mod_vhost_ldap_warmup_count_t {
+    const char *host;
+    int count;				/* Number of times seen */
+    int order;				/* Position of the first occurrence */
+} mod_vhost_ldap_warmup_count_t;
+
+static int mod_vhost_ldap_warmup_compare(const void *a, const void *b)
+{
+    const mod_vhost_ldap_warmup_count_t *x = *(const mod_vhost_ldap_warmup_count_t * const *)a;
+    const mod_vhost_ldap_warmup_count_t *y = *(const mod_vhost_ldap_warmup_count_t * const *)b;
+
+    if (x->count != y->count)
+	return (x->count > y->count) ? -1 : 1;
+    return x->order - y->order;
+}
+
+/*
+ * Common log formats start with the client address (%h) rather than the
+ * Host: header, so tell IP addresses apart from hostnames
+ */
+static int mod_vhost_ldap_warmup_is_ip(const char *host)
+{
+    const char *colon = strchr(host, ':');
+    size_t n = strspn(host, "0123456789.");
+
+    if (*host == '[' || (colon && strchr(colon + 1, ':')))
+	return 1;			/* IPv6 */
+    return n > 0 && (host[n] == '\0' || host[n] == ':');	/* IPv4, maybe with a port */
+}
+
+/*
+ * Read the VhostLDAPWarmup file and return at most conf->cache_entries
+ * hostnames with the number of times each was seen, most requested
+ * first.  For an access log only the last WARMUP_LOG_TAIL bytes are read.
+ */
+static apr_array_header_t *mod_vhost_ldap_warmup_load(apr_pool_t *p, apr_pool_t *ptemp,
+						      server_rec *s, mod_vhost_ldap_config_t *conf)
+{
+    const char *path = ap_server_root_relative(ptemp, conf->warmup_file);
+    apr_hash_t *counts = apr_hash_make(ptemp);
+    apr_array_header_t *seen = apr_array_make(ptemp, 64, sizeof(mod_vhost_ldap_warmup_count_t *));
+    apr_array_header_t *hosts;
+    mod_vhost_ldap_warmup_count_t *count;
+    char line[MAX_STRING_LEN];
+    apr_file_t *f;
+    apr_status_t rv;
+    int i, lines = 0, addresses = 0;
+
+    if (path == NULL ||
+	(rv = apr_file_open(&f, path, APR_READ|APR_BUFFERED, APR_OS_DEFAULT, ptemp)) != APR_SUCCESS) {
+	ap_log_error(APLOG_MARK, APLOG_WARNING, path ? rv : 0, s,
+		     "[mod_vhost_ldap.c] warmup: cannot open %s", conf->warmup_file);
+	return NULL;
+    }
+
+    if (conf->warmup_accesslog) {
+	apr_finfo_t finfo;
+
+	if (apr_file_info_get(&finfo, APR_FINFO_SIZE, f) == APR_SUCCESS
+	    && finfo.size > WARMUP_LOG_TAIL) {
+	    apr_off_t offset = finfo.size - WARMUP_LOG_TAIL;
+
+	    apr_file_seek(f, APR_SET, &offset);
+	    /* Skip the partial line we landed in */
+	    apr_file_gets(line, sizeof(line), f);
+	}
+    }
+
+    while (apr_file_gets(line, sizeof(line), f) == APR_SUCCESS) {
+	char *host = line + strspn(line, " \t");
+
+	if (*host == '#')
+	    continue;
+	host[strcspn(host, " \t\r\n")] = '\0';
+	if (conf->warmup_accesslog) {
+	    lines++;
+	    if (mod_vhost_ldap_warmup_is_ip(host)) {
+		addresses++;
+		continue;
+	    }
+	    /* Strip the port of a Host: header */
+	    host[strcspn(host, ":")] = '\0';
+	}
+	if (*host == '\0' || strcmp(host, "-") == 0)
+	    continue;
+	ap_str_tolower(host);
+
+	count = apr_hash_get(counts, host, APR_HASH_KEY_STRING);
+	if (count == NULL) {
+	    count = apr_pcalloc(ptemp, sizeof(mod_vhost_ldap_warmup_count_t));
+	    count->host = apr_pstrdup(ptemp, host);
+	    count->order = seen->nelts;
+	    apr_hash_set(counts, count->host, APR_HASH_KEY_STRING, count);
+	    *(mod_vhost_ldap_warmup_count_t **)apr_array_push(seen) = count;
+	}
+	count->count++;
+    }
+    apr_file_close(f);
+
+    if (addresses > lines / 2) {
+	ap_log_error(APLOG_MARK, APLOG_WARNING|APLOG_NOERRNO, 0, s,
+		     "[mod_vhost_ldap.c] warmup: %d of %d lines of %s start with an IP "
+		     "address, not a hostname: the log format should start with %%{Host}i",
+		     addresses, lines, conf->warmup_file);
+    }
+
+    qsort(seen->elts, seen->nelts, sizeof(mod_vhost_ldap_warmup_count_t *),
+	  mod_vhost_ldap_warmup_compare);
+
+    hosts = apr_array_make(p, seen->nelts, sizeof(mod_vhost_ldap_warmup_count_t));
+    for (i = 0; i < seen->nelts && i < conf->cache_entries; i++) {
+	mod_vhost_ldap_warmup_count_t *host = apr_array_push(hosts);
+
+	count = ((mod_vhost_ldap_warmup_count_t **)seen->elts)[i];
+	host->host = apr_pstrdup(p, count->host);
+	host->count = count->count;
+	host->order = count->order;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG|APLOG_NOERRNO, 0, s,
+		 "[mod_vhost_ldap.c] warmup: %d of %d hostnames from %s",
+		 hosts->nelts, seen->nelts, path);
+
+    return hosts;
+}
+
 static int mod_vhost_ldap_post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_t *ptemp, server_rec *s)
 {
     module **m;
+    server_rec *sp;
+    apr_hash_t *warmups;
     
     /* Stolen from modules/generators/mod_cgid.c */
     total_modules = 0;
@@ -145,6 +359,29 @@ static int mod_vhost_ldap_post_config(apr_pool_t *p, apr_pool_t *plog, apr_pool_
 
     }
 
+    mod_vhost_ldap_compile_exports(p, s);
+
+    /* Virtual hosts inherit VhostLDAPWarmup: read each file only once */
+    warmups = apr_hash_make(ptemp);
+    for (sp = s; sp; sp = sp->next) {
+	mod_vhost_ldap_config_t *conf =
+	    (mod_vhost_ldap_config_t *)ap_get_module_config(sp->module_config, &vhost_ldap_module);
+
+	if (conf->warmup_file && conf->cache_entries > 0) {
+	    const char *key = apr_psprintf(ptemp, "%s\n%d\n%d", conf->warmup_file,
+					   conf->warmup_accesslog, conf->cache_entries);
+	    mod_vhost_ldap_config_t *loaded = apr_hash_get(warmups, key, APR_HASH_KEY_STRING);
+
+	    if (loaded) {
+		conf->warmup_hosts = loaded->warmup_hosts;
+	    }
+	    else {
+		conf->warmup_hosts = mod_vhost_ldap_warmup_load(p, ptemp, sp, conf);
+		apr_hash_set(warmups, key, APR_HASH_KEY_STRING, conf);
+	    }
+	}
+    }
+
     ap_add_version_component(p, MOD_VHOST_LDAP_VERSION);
 
     return OK;
@@ -164,6 +401,15 @@ mod_vhost_ldap_create_server_config (apr_pool_t *p, server_rec *s)
     conf->deref = always;
     conf->fallback = NULL;
     conf->wildcard = MVL_ENABLED;
+    conf->exports = NULL;
+    conf->cache_entries = -1;
+    conf->cache_ttl = -1;
+    conf->cache = NULL;
+    conf->warmup_file = NULL;
+    conf->warmup_accesslog = 0;
+    conf->warmup_concurrency = -1;
+    conf->warmup_jitter = -1;
+    conf->warmup_hosts = NULL;
 
     return conf;
 }
@@ -212,6 +458,28 @@ mod_vhost_ldap_merge_server_config(apr_pool_t *p, void *parentv, void *childv)
 
     conf->wildcard = (child->wildcard != MVL_UNSET) ? child->wildcard : parent->wildcard;
 
+    if (child->exports && parent->exports) {
+	conf->exports = apr_array_append(p, parent->exports, child->exports);
+    } else if (child->exports) {
+	conf->exports = apr_array_copy(p, child->exports);
+    } else if (parent->exports) {
+	conf->exports = apr_array_copy(p, parent->exports);
+    }
+
+    conf->cache_entries = (child->cache_entries != -1) ? child->cache_entries : parent->cache_entries;
+    conf->cache_ttl = (child->cache_ttl != -1) ? child->cache_ttl : parent->cache_ttl;
+
+    if (child->warmup_file) {
+	conf->warmup_file = child->warmup_file;
+	conf->warmup_accesslog = child->warmup_accesslog;
+    } else {
+	conf->warmup_file = parent->warmup_file;
+	conf->warmup_accesslog = parent->warmup_accesslog;
+    }
+    conf->warmup_concurrency = (child->warmup_concurrency != -1) ?
+	child->warmup_concurrency : parent->warmup_concurrency;
+    conf->warmup_jitter = (child->warmup_jitter != -1) ? child->warmup_jitter : parent->warmup_jitter;
+
     return conf;
 }
 
@@ -414,6 +682,100 @@ static const char *mod_vhost_ldap_set_wildcard(cmd_parms *cmd, void *dummy, int
     return NULL;
 }
 
+static const char *mod_vhost_ldap_add_export(cmd_parms *cmd, void *dummy,
+					     const char *attribute, const char *variable)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(cmd->server->module_config,
+							&vhost_ldap_module);
+    mod_vhost_ldap_export_t *export;
+
+    if (conf->exports == NULL) {
+	conf->exports = apr_array_make(cmd->pool, 4, sizeof(mod_vhost_ldap_export_t));
+    }
+
+    export = (mod_vhost_ldap_export_t *)apr_array_push(conf->exports);
+    export->attribute = apr_pstrdup(cmd->pool, attribute);
+    export->variable = apr_pstrdup(cmd->pool, variable);
+    export->index = -1;
+
+    return NULL;
+}
+
+static const char *mod_vhost_ldap_set_cache_entries(cmd_parms *cmd, void *dummy, const char *entries)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(cmd->server->module_config,
+							&vhost_ldap_module);
+
+    conf->cache_entries = atoi(entries);
+    if (conf->cache_entries < 0) {
+	return "VhostLDAPCacheEntries must be a non-negative number";
+    }
+    return NULL;
+}
+
+static const char *mod_vhost_ldap_set_cache_ttl(cmd_parms *cmd, void *dummy, const char *ttl)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(cmd->server->module_config,
+							&vhost_ldap_module);
+
+    conf->cache_ttl = atoi(ttl);
+    if (conf->cache_ttl <= 0) {
+	return "VhostLDAPCacheTTL must be a positive number of seconds";
+    }
+    return NULL;
+}
+
+static const char *mod_vhost_ldap_set_warmup(cmd_parms *cmd, void *dummy,
+					     const char *type, const char *file)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(cmd->server->module_config,
+							&vhost_ldap_module);
+
+    if (strcasecmp(type, "hostlist") == 0) {
+	conf->warmup_accesslog = 0;
+    }
+    else if (strcasecmp(type, "accesslog") == 0) {
+	conf->warmup_accesslog = 1;
+    }
+    else {
+	return "VhostLDAPWarmup type must be \"hostlist\" or \"accesslog\"";
+    }
+
+    conf->warmup_file = apr_pstrdup(cmd->pool, file);
+    return NULL;
+}
+
+static const char *mod_vhost_ldap_set_warmup_concurrency(cmd_parms *cmd, void *dummy,
+							 const char *concurrency)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(cmd->server->module_config,
+							&vhost_ldap_module);
+
+    conf->warmup_concurrency = atoi(concurrency);
+    if (conf->warmup_concurrency <= 0) {
+	return "VhostLDAPWarmupConcurrency must be a positive number";
+    }
+    return NULL;
+}
+
+static const char *mod_vhost_ldap_set_warmup_jitter(cmd_parms *cmd, void *dummy, const char *jitter)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(cmd->server->module_config,
+							&vhost_ldap_module);
+
+    conf->warmup_jitter = atoi(jitter);
+    if (conf->warmup_jitter < 0) {
+	return "VhostLDAPWarmupJitter must be a non-negative number of seconds";
+    }
+    return NULL;
+}
+
 command_rec mod_vhost_ldap_cmds[] = {
     AP_INIT_TAKE1("VhostLDAPURL", mod_vhost_ldap_parse_url, NULL, RSRC_CONF,
                   "URL to define LDAP connection. This should be an RFC 2255 compliant\n"
@@ -447,48 +809,82 @@ command_rec mod_vhost_ldap_cmds[] = {
     AP_INIT_FLAG("VhostLDAPWildcard", mod_vhost_ldap_set_wildcard, NULL, RSRC_CONF,
                  "Set to off to disable wildcard search if the requested hostname is not found."),
 
+    AP_INIT_TAKE2("VhostLDAPExportAttribute", mod_vhost_ldap_add_export, NULL, RSRC_CONF,
+                  "Fetch an additional LDAP attribute with the virtual host entry and export "
+                  "its value as the given environment variable and request note."),
+
+    AP_INIT_TAKE1("VhostLDAPCacheEntries", mod_vhost_ldap_set_cache_entries, NULL, RSRC_CONF,
+                  "Maximum number of resolved virtual hosts cached in each process. "
+                  "Defaults to 0 (no cache)."),
+
+    AP_INIT_TAKE1("VhostLDAPCacheTTL", mod_vhost_ldap_set_cache_ttl, NULL, RSRC_CONF,
+                  "Number of seconds a cached virtual host is used before it is looked up again. "
+                  "Defaults to 60."),
+
+    AP_INIT_TAKE2("VhostLDAPWarmup", mod_vhost_ldap_set_warmup, NULL, RSRC_CONF,
+                  "Fill the vhost cache when a process starts. The first argument is \"hostlist\" "
+                  "for a file with one hostname per line, or \"accesslog\" for an access log whose "
+                  "first field is the requested hostname (%{Host}i), of which the tail is read "
+                  "and the most requested hostnames are used."),
+
+    AP_INIT_TAKE1("VhostLDAPWarmupConcurrency", mod_vhost_ldap_set_warmup_concurrency, NULL, RSRC_CONF,
+                  "Maximum number of LDAP searches run in parallel by the warmup. Defaults to 4."),
+
+    AP_INIT_TAKE1("VhostLDAPWarmupJitter", mod_vhost_ldap_set_warmup_jitter, NULL, RSRC_CONF,
+                  "Maximum number of seconds each warmup worker waits at random before it starts, "
+                  "so that restarted processes do not all hit the LDAP server at once. Defaults to 10."),
+
     {NULL}
 };
 
+static apr_status_t mod_vhost_ldap_cache_report(void *data)
+{
+    server_rec *s = data;
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(s->module_config, &vhost_ldap_module);
+    mod_vhost_ldap_cache_stats_t st;
+
+    mod_vhost_ldap_cache_stats(conf->cache, &st);
+
+    ap_log_error(APLOG_MARK, APLOG_INFO|APLOG_NOERRNO, 0, s,
+		 "[mod_vhost_ldap.c] cache: %" APR_UINT64_T_FMT " hits, %" APR_UINT64_T_FMT
+		 " misses (hit ratio %.1f%%), %" APR_UINT64_T_FMT " admitted, %" APR_UINT64_T_FMT
+		 " rejected, %" APR_UINT64_T_FMT " evicted, %" APR_UINT64_T_FMT " expired",
+		 st.hits, st.misses, (st.hits + st.misses) ? 100.0 * st.hits / (st.hits + st.misses) : 0.0,
+		 st.admitted, st.rejected, st.evicted, st.expired);
+
+    return APR_SUCCESS;
+}
+
 #define FILTER_LENGTH MAX_STRING_LEN
-static int mod_vhost_ldap_translate_name(request_rec *r)
+/*
+ * Search LDAP for hostname, trying wildcards and the fallback vhost if it
+ * is not found.  Returns OK and sets dn and vals on success, an HTTP error
+ * otherwise.
+ */
+static int mod_vhost_ldap_lookup(request_rec *r, mod_vhost_ldap_config_t *conf,
+				 mod_vhost_ldap_request_t *reqc, const char *hostname,
+				 int max_failures, const char **dn, const char ***vals)
 {
-    mod_vhost_ldap_request_t *reqc;
     int failures = 0;
-    const char **vals = NULL;
     char filtbuf[FILTER_LENGTH];
-    mod_vhost_ldap_config_t *conf =
-	(mod_vhost_ldap_config_t *)ap_get_module_config(r->server->module_config, &vhost_ldap_module);
     util_ldap_connection_t *ldc = NULL;
     int result = 0;
-    const char *dn = NULL;
-    char *cgi;
-    const char *hostname = NULL;
     int is_fallback = 0;
     int sleep0 = 0;
     int sleep1 = 1;
     int sleep;
     struct berval hostnamebv, shostnamebv;
-    char *document_root;
-    int ret = DECLINED;
-
-    reqc =
-	(mod_vhost_ldap_request_t *)apr_pcalloc(r->pool, sizeof(mod_vhost_ldap_request_t));
-    memset(reqc, 0, sizeof(mod_vhost_ldap_request_t)); 
-
-    ap_set_module_config(r->request_config, &vhost_ldap_module, reqc);
-
-    // mod_vhost_ldap is disabled or we don't have LDAP Url
-    if ((conf->enabled != MVL_ENABLED)||(!conf->have_ldap_url)) {
-	return DECLINED;
-    }
+    apr_time_t t;
 
 start_over:
 
     if (conf->host) {
+        t = apr_time_now();
         ldc = util_ldap_connection_find(r, conf->host, conf->port,
 					conf->binddn, conf->bindpw, conf->deref,
 					conf->secure);
+        reqc->connect_time += apr_time_now() - t;
     }
     else {
         ap_log_rerror(APLOG_MARK, APLOG_WARNING|APLOG_NOERRNO, 0, r, 
@@ -496,7 +892,6 @@ start_over:
         return HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    hostname = r->hostname;
     if (hostname == NULL || hostname[0] == '\0')
         goto null;
 
@@ -512,12 +907,15 @@ fallback:
     apr_snprintf(filtbuf, FILTER_LENGTH, "(&(%s)(|(apacheServerName=%s)(apacheServerAlias=%s)))", conf->filter, shostnamebv.bv_val, shostnamebv.bv_val);
     ber_memfree(shostnamebv.bv_val);
 
+    t = apr_time_now();
     result = util_ldap_cache_getuserdn(r, ldc, conf->url, conf->basedn, conf->scope,
-				       attributes, filtbuf, &dn, &vals);
+				       search_attributes, filtbuf, dn, vals);
 
     util_ldap_connection_close(ldc);
+    reqc->search_time += apr_time_now() - t;
+    reqc->searches++;
 
-    /* sanity check - if server is down, retry it up to 5 times */
+    /* sanity check - if server is down, retry it up to max_failures times */
     if (AP_LDAP_IS_SERVER_DOWN(result) ||
 	(result == LDAP_TIMEOUT) ||
 	(result == LDAP_CONNECT_ERROR)) {
@@ -525,9 +923,12 @@ fallback:
         ap_log_rerror(APLOG_MARK, APLOG_WARNING|APLOG_NOERRNO, 0, r,
 		      "[mod_vhost_ldap.c]: lookup failure, retry number #[%d], sleeping for [%d] seconds",
 		      failures, sleep);
-        if (failures++ < MAX_FAILURES) {
+        if (failures++ < max_failures) {
 	    /* Back-off exponentially */
+	    t = apr_time_now();
 	    apr_sleep(apr_time_from_sec(sleep));
+	    reqc->retry_time += apr_time_now() - t;
+	    reqc->retries++;
 	    sleep0 = sleep1;
 	    sleep1 = sleep;
             goto start_over;
@@ -543,6 +944,7 @@ fallback:
 		    hostname += 2;
                 hostname += strcspn(hostname, ".");
                 hostname = apr_pstrcat(r->pool, "*", hostname, NULL);
+                reqc->wildcard++;
                 ap_log_rerror(APLOG_MARK, APLOG_NOTICE|APLOG_NOERRNO, 0, r,
 		              "[mod_vhost_ldap.c] translate: "
 			      "virtual host not found, trying wildcard %s",
@@ -558,6 +960,7 @@ null:
 			  "virtual host %s not found, trying fallback %s",
 			  hostname, conf->fallback);
 	    hostname = conf->fallback;
+	    reqc->fallback = 1;
 	    goto fallback;
 	}
 
@@ -578,6 +981,53 @@ null:
 	return HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    return OK;
+}
+
+static int mod_vhost_ldap_translate_name_doer(request_rec *r)
+{
+    mod_vhost_ldap_request_t *reqc;
+    const char **vals = NULL;
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(r->server->module_config, &vhost_ldap_module);
+    int result = 0;
+    const char *dn = NULL;
+    char *cgi;
+    char *document_root;
+    int ret = DECLINED;
+    apr_time_t t;
+
+    reqc =
+	(mod_vhost_ldap_request_t *)apr_pcalloc(r->pool, sizeof(mod_vhost_ldap_request_t));
+    memset(reqc, 0, sizeof(mod_vhost_ldap_request_t)); 
+
+    ap_set_module_config(r->request_config, &vhost_ldap_module, reqc);
+
+    // mod_vhost_ldap is disabled or we don't have LDAP Url
+    if ((conf->enabled != MVL_ENABLED)||(!conf->have_ldap_url)) {
+	return DECLINED;
+    }
+
+    if (conf->cache && r->hostname && r->hostname[0]) {
+	if (mod_vhost_ldap_cache_lookup(conf->cache, r->hostname, r->pool, &dn, &vals,
+					&reqc->wildcard, &reqc->fallback)) {
+	    reqc->cache = "hit";
+	    goto found;
+	}
+	reqc->cache = "miss";
+    }
+
+    result = mod_vhost_ldap_lookup(r, conf, reqc, r->hostname, MAX_FAILURES, &dn, &vals);
+    if (result != OK) {
+	return result;
+    }
+
+    if (reqc->cache && vals) {
+	mod_vhost_ldap_cache_insert(conf->cache, r->hostname, dn, vals,
+				    reqc->wildcard, reqc->fallback);
+    }
+
+found:
     /* mark the user and DN */
     reqc->dn = apr_pstrdup(r->pool, dn);
 
@@ -606,6 +1056,21 @@ null:
 	    }
 	    i++;
 	}
+
+	if (conf->exports) {
+	    const mod_vhost_ldap_export_t *exports =
+		(const mod_vhost_ldap_export_t *)conf->exports->elts;
+
+	    for (i = 0; i < conf->exports->nelts; i++) {
+		const char *val = vals[exports[i].index];
+
+		if (val) {
+		    val = apr_pstrdup(r->pool, val);
+		    apr_table_setn(r->subprocess_env, exports[i].variable, val);
+		    apr_table_setn(r->notes, exports[i].variable, val);
+		}
+	    }
+	}
     }
 
     ap_log_rerror(APLOG_MARK, APLOG_DEBUG|APLOG_NOERRNO, 0, r,
@@ -655,12 +1120,15 @@ null:
 	return DECLINED;
     }
 
+    t = apr_time_now();
+
     document_root = apr_pstrdup(r->pool, ap_context_document_root(r));
 
     /* Make it absolute, relative to ServerRoot */
     reqc->docroot = ap_server_root_relative(r->pool, reqc->docroot);
 
     if (reqc->docroot == NULL) {
+        reqc->docroot_time = apr_time_now() - t;
         ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, 
                       "[mod_vhost_ldap.c] set_document_root: DocumentRoot must be a directory");
 
@@ -678,6 +1146,8 @@ null:
         document_root = reqc->docroot;
     }
 
+    reqc->docroot_time = apr_time_now() - t;
+
     ap_set_context_info(r, NULL, document_root);
     ap_set_document_root(r, document_root);
 
@@ -685,6 +1155,354 @@ null:
     return ret;
 }
 
+/*
+ * Export the per request statistics as notes, so they can be logged
+ * with %{vhost-ldap-...}n in LogFormat.  Times are in microseconds.
+ */
+static int mod_vhost_ldap_translate_name(request_rec *r)
+{
+    mod_vhost_ldap_config_t *conf =
+	(mod_vhost_ldap_config_t *)ap_get_module_config(r->server->module_config, &vhost_ldap_module);
+    mod_vhost_ldap_request_t *reqc;
+    apr_time_t start = apr_time_now();
+    int ret;
+
+    ret = mod_vhost_ldap_translate_name_doer(r);
+
+    if ((conf->enabled != MVL_ENABLED)||(!conf->have_ldap_url)) {
+	return ret;
+    }
+
+    reqc = (mod_vhost_ldap_request_t *)ap_get_module_config(r->request_config, &vhost_ldap_module);
+
+    apr_table_setn(r->notes, "vhost-ldap-time-total",
+		   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, apr_time_now() - start));
+    apr_table_setn(r->notes, "vhost-ldap-time-connect",
+		   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, reqc->connect_time));
+    apr_table_setn(r->notes, "vhost-ldap-time-search",
+		   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, reqc->search_time));
+    apr_table_setn(r->notes, "vhost-ldap-time-retry",
+		   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, reqc->retry_time));
+    apr_table_setn(r->notes, "vhost-ldap-time-docroot",
+		   apr_psprintf(r->pool, "%" APR_TIME_T_FMT, reqc->docroot_time));
+    apr_table_setn(r->notes, "vhost-ldap-searches", apr_itoa(r->pool, reqc->searches));
+    apr_table_setn(r->notes, "vhost-ldap-retries", apr_itoa(r->pool, reqc->retries));
+    apr_table_setn(r->notes, "vhost-ldap-wildcard", apr_itoa(r->pool, reqc->wildcard));
+    apr_table_setn(r->notes, "vhost-ldap-fallback", reqc->fallback ? "1" : "0");
+    if (reqc->cache) {
+	apr_table_setn(r->notes, "vhost-ldap-cache", reqc->cache);
+    }
+
+    return ret;
+}
+
+/*
+ * Cache warmup.  Each process resolves the VhostLDAPWarmup hostnames in
+ * the background when it starts, with at most VhostLDAPWarmupConcurrency
+ * searches in flight, each worker starting after a random delay of up to
+ * VhostLDAPWarmupJitter seconds.
+ */
+typedef struct mod_vhost_ldap_warmup_t {
+    server_rec *s;
+    mod_vhost_ldap_config_t *conf;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_t **threads;
+#endif
+    int nworkers;
+    int running;			/* Workers not finished yet */
+    int next;				/* Next hostname to resolve */
+    int resolved;
+    int failed;
+    volatile int stop;			/* Set when the process exits or the warmup is aborted */
+    int aborted;			/* Set when the directory was unreachable */
+    apr_time_t start;
+} mod_vhost_ldap_warmup_t;
+
+typedef struct mod_vhost_ldap_warmup_worker_t {
+    mod_vhost_ldap_warmup_t *warmup;
+    apr_pool_t *pool;
+    apr_interval_time_t delay;
+} mod_vhost_ldap_warmup_worker_t;
+
+/*
+ * mod_ldap only works on behalf of a request, so build a minimal one,
+ * the same way other modules do for requests of their own.
+ */
+static request_rec *mod_vhost_ldap_warmup_request(apr_pool_t *p, server_rec *s, const char *hostname)
+{
+    conn_rec *c = apr_pcalloc(p, sizeof(conn_rec));
+    request_rec *r = apr_pcalloc(p, sizeof(request_rec));
+
+    c->pool = p;
+    c->base_server = s;
+    c->conn_config = ap_create_conn_config(p);
+    c->notes = apr_table_make(p, 1);
+    c->client_ip = "127.0.0.1";
+    c->local_ip = "127.0.0.1";
+    c->local_host = s->server_hostname;
+
+    r->pool = p;
+    r->connection = c;
+    r->server = s;
+    r->request_time = apr_time_now();
+    r->hostname = hostname;
+    r->method = "GET";
+    r->protocol = "INTERNAL";
+    r->the_request = "vhost_ldap warmup";
+    r->uri = "/";
+    r->useragent_ip = c->client_ip;
+    r->headers_in = apr_table_make(p, 1);
+    r->headers_out = apr_table_make(p, 1);
+    r->err_headers_out = apr_table_make(p, 1);
+    r->subprocess_env = apr_table_make(p, 1);
+    r->notes = apr_table_make(p, 1);
+    r->request_config = ap_create_request_config(p);
+    r->per_dir_config = s->lookup_defaults;
+
+    return r;
+}
+
+static APR_INLINE void mod_vhost_ldap_warmup_lock(mod_vhost_ldap_warmup_t *warmup)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(warmup->mutex);
+#endif
+}
+
+static APR_INLINE void mod_vhost_ldap_warmup_unlock(mod_vhost_ldap_warmup_t *warmup)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(warmup->mutex);
+#endif
+}
+
+static void mod_vhost_ldap_warmup_run(mod_vhost_ldap_warmup_worker_t *worker)
+{
+    mod_vhost_ldap_warmup_t *warmup = worker->warmup;
+    mod_vhost_ldap_config_t *conf = warmup->conf;
+    apr_time_t until = apr_time_now() + worker->delay;
+    /* Hostnames are sorted, most requested first */
+    int top = ((mod_vhost_ldap_warmup_count_t *)conf->warmup_hosts->elts)[0].count;
+    int i, last, unreachable;
+
+    while (!warmup->stop && apr_time_now() < until) {
+	apr_sleep(apr_time_from_msec(100));
+    }
+
+    while (!warmup->stop) {
+	mod_vhost_ldap_request_t reqc;
+	mod_vhost_ldap_warmup_count_t *host;
+	const char *hostname, *dn = NULL;
+	const char **vals = NULL;
+	request_rec *r;
+	int result;
+
+	mod_vhost_ldap_warmup_lock(warmup);
+	i = warmup->next++;
+	mod_vhost_ldap_warmup_unlock(warmup);
+	if (i >= conf->warmup_hosts->nelts)
+	    break;
+
+	host = &((mod_vhost_ldap_warmup_count_t *)conf->warmup_hosts->elts)[i];
+	hostname = host->host;
+	apr_pool_clear(worker->pool);
+	r = mod_vhost_ldap_warmup_request(worker->pool, warmup->s, hostname);
+	memset(&reqc, 0, sizeof(reqc));
+
+	/* Don't retry: a down server should not keep the process busy */
+	result = mod_vhost_ldap_lookup(r, conf, &reqc, hostname, 0, &dn, &vals);
+	if (result == OK && vals) {
+	    /*
+	     * Give the entry the popularity it had in the file, otherwise it
+	     * counts as never requested and the first scan evicts it.  Counts
+	     * are scaled to the most requested hostname (the first one), so
+	     * that they don't all saturate the cache's counters.
+	     */
+	    mod_vhost_ldap_cache_touch(conf->cache, hostname,
+		1 + (int)((apr_int64_t)(MOD_VHOST_LDAP_CACHE_MAX_FREQUENCY - 1) * host->count / top));
+	    mod_vhost_ldap_cache_insert(conf->cache, hostname, dn, vals,
+					reqc.wildcard, reqc.fallback);
+	}
+
+	mod_vhost_ldap_warmup_lock(warmup);
+	if (result == OK && vals)
+	    warmup->resolved++;
+	else
+	    warmup->failed++;
+	/*
+	 * The directory is unreachable: give up rather than keep every
+	 * worker blocked in it, which would also hold up the process exit
+	 */
+	unreachable = (result == HTTP_GATEWAY_TIME_OUT && !warmup->aborted);
+	if (unreachable) {
+	    warmup->aborted = 1;
+	    warmup->stop = 1;
+	}
+	mod_vhost_ldap_warmup_unlock(warmup);
+
+	if (unreachable) {
+	    ap_log_error(APLOG_MARK, APLOG_WARNING|APLOG_NOERRNO, 0, warmup->s,
+			 "[mod_vhost_ldap.c] warmup: LDAP server down while resolving %s, "
+			 "aborting warmup", hostname);
+	}
+    }
+
+    mod_vhost_ldap_warmup_lock(warmup);
+    last = (--warmup->running == 0);
+    mod_vhost_ldap_warmup_unlock(warmup);
+
+    if (last) {
+	ap_log_error(APLOG_MARK, APLOG_INFO|APLOG_NOERRNO, 0, warmup->s,
+		     "[mod_vhost_ldap.c] warmup: %d hostnames cached, %d failed, in %"
+		     APR_TIME_T_FMT " ms%s",
+		     warmup->resolved, warmup->failed,
+		     apr_time_msec(apr_time_now() - warmup->start),
+		     warmup->aborted ? " (aborted)" : warmup->stop ? " (interrupted)" : "");
+    }
+}
+
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC mod_vhost_ldap_warmup_thread(apr_thread_t *thd, void *data)
+{
+    mod_vhost_ldap_warmup_run((mod_vhost_ldap_warmup_worker_t *)data);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Runs before the worker pools are destroyed */
+static apr_status_t mod_vhost_ldap_warmup_stop(void *data)
+{
+    mod_vhost_ldap_warmup_t *warmup = data;
+    apr_status_t rv;
+    int i;
+
+    warmup->stop = 1;
+    for (i = 0; i < warmup->nworkers; i++) {
+	if (warmup->threads[i])
+	    apr_thread_join(&rv, warmup->threads[i]);
+    }
+    return APR_SUCCESS;
+}
+#endif
+
+static void mod_vhost_ldap_warmup_start(apr_pool_t *p, server_rec *s, mod_vhost_ldap_config_t *conf)
+{
+    mod_vhost_ldap_warmup_t *warmup = apr_pcalloc(p, sizeof(mod_vhost_ldap_warmup_t));
+    mod_vhost_ldap_warmup_worker_t *workers;
+    int jitter = (conf->warmup_jitter >= 0) ? conf->warmup_jitter : DEFAULT_WARMUP_JITTER;
+    int i;
+
+    warmup->s = s;
+    warmup->conf = conf;
+    warmup->start = apr_time_now();
+    warmup->nworkers = (conf->warmup_concurrency > 0) ?
+	conf->warmup_concurrency : DEFAULT_WARMUP_CONCURRENCY;
+    if (warmup->nworkers > conf->warmup_hosts->nelts)
+	warmup->nworkers = conf->warmup_hosts->nelts;
+    warmup->running = warmup->nworkers;
+
+    workers = apr_pcalloc(p, warmup->nworkers * sizeof(mod_vhost_ldap_warmup_worker_t));
+    for (i = 0; i < warmup->nworkers; i++) {
+	apr_uint32_t rnd = 0;
+
+	workers[i].warmup = warmup;
+	apr_pool_create(&workers[i].pool, p);
+	if (jitter > 0) {
+	    apr_generate_random_bytes((unsigned char *)&rnd, sizeof(rnd));
+	    workers[i].delay = apr_time_from_msec(rnd % (jitter * 1000 + 1));
+	}
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_create(&warmup->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    warmup->threads = apr_pcalloc(p, warmup->nworkers * sizeof(apr_thread_t *));
+    apr_pool_pre_cleanup_register(p, warmup, mod_vhost_ldap_warmup_stop);
+
+    for (i = 0; i < warmup->nworkers; i++) {
+	apr_status_t rv = apr_thread_create(&warmup->threads[i], NULL,
+					    mod_vhost_ldap_warmup_thread, &workers[i], p);
+	if (rv != APR_SUCCESS) {
+	    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			 "[mod_vhost_ldap.c] warmup: cannot create thread");
+	    warmup->threads[i] = NULL;
+	    mod_vhost_ldap_warmup_lock(warmup);
+	    warmup->running--;
+	    mod_vhost_ldap_warmup_unlock(warmup);
+	}
+    }
+#else
+    /* Without threads, warm up synchronously and without jitter */
+    for (i = 0; i < warmup->nworkers; i++) {
+	workers[i].delay = 0;
+	mod_vhost_ldap_warmup_run(&workers[i]);
+    }
+#endif
+}
+
+/*
+ * Everything that changes what a hostname resolves to, or how it is
+ * cached: servers with the same key can share a cache
+ */
+static const char *mod_vhost_ldap_cache_key(apr_pool_t *p, mod_vhost_ldap_config_t *conf)
+{
+    return apr_psprintf(p, "%s\n%s\n%s\n%d\n%s\n%d\n%d\n%d", conf->url,
+			conf->binddn ? conf->binddn : "", conf->bindpw ? conf->bindpw : "",
+			(int)conf->deref, conf->fallback ? conf->fallback : "",
+			conf->wildcard, conf->cache_entries, conf->cache_ttl);
+}
+
+static void mod_vhost_ldap_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_pool_t *ptemp;
+    apr_hash_t *caches, *warmups;
+    int nattrs;
+
+    for (nattrs = 0; search_attributes[nattrs]; nattrs++)
+	;
+
+    /*
+     * Virtual hosts inherit the main server's settings: rather than a cache
+     * and a warmup each, share them between all the servers that search
+     * the directory the same way
+     */
+    apr_pool_create(&ptemp, p);
+    caches = apr_hash_make(ptemp);
+    warmups = apr_hash_make(ptemp);
+
+    for (; s; s = s->next) {
+	mod_vhost_ldap_config_t *conf =
+	    (mod_vhost_ldap_config_t *)ap_get_module_config(s->module_config, &vhost_ldap_module);
+	mod_vhost_ldap_config_t *shared;
+	const char *key;
+
+	if ((conf->enabled != MVL_ENABLED)||(!conf->have_ldap_url)||(conf->cache_entries <= 0))
+	    continue;
+
+	key = mod_vhost_ldap_cache_key(ptemp, conf);
+	shared = apr_hash_get(caches, key, APR_HASH_KEY_STRING);
+	if (shared) {
+	    conf->cache = shared->cache;
+	}
+	else {
+	    conf->cache = mod_vhost_ldap_cache_create(p, conf->cache_entries, nattrs,
+		    apr_time_from_sec((conf->cache_ttl > 0) ? conf->cache_ttl : DEFAULT_CACHE_TTL));
+	    apr_pool_cleanup_register(p, s, mod_vhost_ldap_cache_report, apr_pool_cleanup_null);
+	    apr_hash_set(caches, key, APR_HASH_KEY_STRING, conf);
+	}
+
+	if (conf->warmup_hosts && conf->warmup_hosts->nelts > 0) {
+	    key = apr_psprintf(ptemp, "%pp %pp", conf->cache, conf->warmup_hosts);
+	    if (apr_hash_get(warmups, key, APR_HASH_KEY_STRING) == NULL) {
+		apr_hash_set(warmups, key, APR_HASH_KEY_STRING, conf);
+		mod_vhost_ldap_warmup_start(p, s, conf);
+	    }
+	}
+    }
+
+    apr_pool_destroy(ptemp);
+}
+
 #ifdef HAVE_UNIX_SUEXEC
 static ap_unix_identity_t *mod_vhost_ldap_get_suexec_id_doer(const request_rec * r)
 {
@@ -736,7 +1554,14 @@ mod_vhost_ldap_register_hooks (apr_pool_t * p)
      */
     static const char * const aszRewrite[]={ "mod_rewrite.c", NULL };
 
+    /*
+     * The warmup searches through mod_ldap, whose child_init sets up the
+     * connection and cache mutexes
+     */
+    static const char * const aszLDAP[]={ "util_ldap.c", NULL };
+
     ap_hook_post_config(mod_vhost_ldap_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(mod_vhost_ldap_child_init, aszLDAP, NULL, APR_HOOK_MIDDLE);
     ap_hook_translate_name(mod_vhost_ldap_translate_name, NULL, aszRewrite, APR_HOOK_FIRST);
 #ifdef HAVE_UNIX_SUEXEC
     ap_hook_get_suexec_identity(mod_vhost_ldap_get_suexec_id_doer, NULL, NULL, APR_HOOK_MIDDLE);
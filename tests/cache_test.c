@@ -0,0 +1,347 @@
+/*
+ * cache_test.c --- unit tests for the vhost cache (vhost_ldap_cache.c)
+ *
+ * Only needs APR:  make test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+#include "apr_strings.h"
+#include "apr_thread_proc.h"
+#include "apr_time.h"
+
+#include "vhost_ldap_cache.h"
+
+#define NATTRS 2
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+	fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, __func__, #cond); \
+	failures++; \
+    } \
+} while (0)
+
+static const char *test_vals[NATTRS + 1] = { "value", NULL, NULL };
+
+static void insert(mod_vhost_ldap_cache_t *cache, const char *hostname)
+{
+    mod_vhost_ldap_cache_insert(cache, hostname, "cn=test", test_vals, 0, 0);
+}
+
+static int lookup(mod_vhost_ldap_cache_t *cache, const char *hostname, apr_pool_t *p)
+{
+    const char *dn, **vals;
+    int wildcard, fallback;
+
+    return mod_vhost_ldap_cache_lookup(cache, hostname, p, &dn, &vals, &wildcard, &fallback);
+}
+
+/* Miss, insert, then a hit returning copies of everything stored */
+static void test_roundtrip(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 100, NATTRS, apr_time_from_sec(60));
+    const char *vals[NATTRS + 1] = { "/var/www/a", NULL, NULL };
+    const char *dn = NULL, **got = NULL;
+    int wildcard = -1, fallback = -1;
+    mod_vhost_ldap_cache_stats_t st;
+
+    CHECK(mod_vhost_ldap_cache_lookup(cache, "a.example", p, &dn, &got, &wildcard, &fallback) == 0);
+
+    mod_vhost_ldap_cache_insert(cache, "a.example", "apacheServerName=*.example", vals, 1, 0);
+    mod_vhost_ldap_cache_insert(cache, "b.example", "apacheServerName=default", vals, 0, 1);
+
+    CHECK(mod_vhost_ldap_cache_lookup(cache, "a.example", p, &dn, &got, &wildcard, &fallback) == 1);
+    CHECK(strcmp(dn, "apacheServerName=*.example") == 0);
+    CHECK(got[0] != vals[0] && strcmp(got[0], "/var/www/a") == 0);
+    CHECK(got[1] == NULL);
+    CHECK(wildcard == 1 && fallback == 0);
+
+    CHECK(mod_vhost_ldap_cache_lookup(cache, "b.example", p, &dn, &got, &wildcard, &fallback) == 1);
+    CHECK(wildcard == 0 && fallback == 1);
+
+    mod_vhost_ldap_cache_stats(cache, &st);
+    CHECK(st.hits == 2 && st.misses == 1 && st.entries == 2);
+}
+
+/* Re-inserting a hostname replaces the entry instead of duplicating it */
+static void test_replace(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 100, NATTRS, apr_time_from_sec(60));
+    const char *vals[NATTRS + 1] = { "new", NULL, NULL };
+    const char *dn, **got;
+    int wildcard, fallback;
+    mod_vhost_ldap_cache_stats_t st;
+
+    insert(cache, "a.example");
+    mod_vhost_ldap_cache_insert(cache, "a.example", "cn=new", vals, 0, 0);
+
+    CHECK(mod_vhost_ldap_cache_lookup(cache, "a.example", p, &dn, &got, &wildcard, &fallback) == 1);
+    CHECK(strcmp(dn, "cn=new") == 0 && strcmp(got[0], "new") == 0);
+
+    mod_vhost_ldap_cache_stats(cache, &st);
+    CHECK(st.entries == 1);
+}
+
+static void test_expiry(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 100, NATTRS, apr_time_from_msec(10));
+    mod_vhost_ldap_cache_stats_t st;
+
+    insert(cache, "a.example");
+    CHECK(lookup(cache, "a.example", p) == 1);
+    apr_sleep(apr_time_from_msec(30));
+    CHECK(lookup(cache, "a.example", p) == 0);
+
+    mod_vhost_ldap_cache_stats(cache, &st);
+    CHECK(st.expired == 1 && st.entries == 0);
+}
+
+/* The cache never holds more than its capacity */
+static void test_bounded(apr_pool_t *p)
+{
+    int capacities[] = { 1, 2, 10, 100, 1000, 5000 };
+    char host[64];
+    unsigned int c;
+    int i;
+
+    for (c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+	mod_vhost_ldap_cache_t *cache =
+	    mod_vhost_ldap_cache_create(p, capacities[c], NATTRS, apr_time_from_sec(60));
+	mod_vhost_ldap_cache_stats_t st;
+
+	for (i = 0; i < capacities[c] * 20; i++) {
+	    apr_snprintf(host, sizeof(host), "h%d.example", i % (capacities[c] * 3));
+	    if (!lookup(cache, host, p))
+		insert(cache, host);
+	}
+
+	mod_vhost_ldap_cache_stats(cache, &st);
+	CHECK(st.entries > 0);
+	CHECK(st.entries <= (apr_uint64_t)capacities[c]);
+    }
+}
+
+/* A hostname requested often displaces a main segment entry seen once */
+static void test_admission(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 100, NATTRS, apr_time_from_sec(60));
+    mod_vhost_ldap_cache_stats_t st;
+    char host[64];
+    int i;
+
+    /* Fill the cache with entries requested once */
+    for (i = 0; i < 100; i++) {
+	apr_snprintf(host, sizeof(host), "once%d.example", i);
+	lookup(cache, host, p);
+	insert(cache, host);
+    }
+
+    /* A popular hostname that has not been cached yet */
+    for (i = 0; i < 5; i++)
+	lookup(cache, "popular.example", p);
+    insert(cache, "popular.example");
+
+    /* Push it out of the window */
+    lookup(cache, "pusher.example", p);
+    insert(cache, "pusher.example");
+
+    CHECK(lookup(cache, "popular.example", p) == 1);
+    mod_vhost_ldap_cache_stats(cache, &st);
+    CHECK(st.evicted >= 1);
+}
+
+/* Popularity counted with touch, as the warmup does, also wins admission */
+static void test_touch(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 100, NATTRS, apr_time_from_sec(60));
+    char host[64];
+    int i;
+
+    for (i = 0; i < 100; i++) {
+	apr_snprintf(host, sizeof(host), "once%d.example", i);
+	lookup(cache, host, p);
+	insert(cache, host);
+    }
+
+    /* Warmed without ever being looked up */
+    mod_vhost_ldap_cache_touch(cache, "warmed.example", 5);
+    insert(cache, "warmed.example");
+    insert(cache, "cold.example");
+
+    for (i = 0; i < 10; i++) {
+	apr_snprintf(host, sizeof(host), "pusher%d.example", i);
+	lookup(cache, host, p);
+	insert(cache, host);
+    }
+
+    CHECK(lookup(cache, "warmed.example", p) == 1);
+    CHECK(lookup(cache, "cold.example", p) == 0);
+}
+
+/*
+ * Seeding many hostnames does not age the popularity of those seeded
+ * first: "warmed" must still beat an entry seeded once less, after more
+ * seeding than the sketch's aging period (10 times the capacity).
+ */
+static void test_touch_no_aging(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 100, NATTRS, apr_time_from_sec(60));
+    char host[64];
+    int i;
+
+    mod_vhost_ldap_cache_touch(cache, "warmed.example", 15);
+    for (i = 0; i < 70; i++) {
+	apr_snprintf(host, sizeof(host), "seeded%d.example", i);
+	mod_vhost_ldap_cache_touch(cache, host, 15);
+    }
+    mod_vhost_ldap_cache_touch(cache, "victim.example", 14);
+
+    /* "victim" ends up the main segment's LRU */
+    insert(cache, "victim.example");
+    for (i = 0; i < 99; i++) {
+	apr_snprintf(host, sizeof(host), "pad%d.example", i);
+	insert(cache, host);
+    }
+    insert(cache, "warmed.example");
+    insert(cache, "pusher.example");
+
+    CHECK(lookup(cache, "warmed.example", p) == 1);
+    CHECK(lookup(cache, "victim.example", p) == 0);
+}
+
+/*
+ * A hot set of hostnames survives heavy traffic of hostnames that are
+ * requested only once, as random scans do.  The hot set nearly fills the
+ * cache, so every scan admitted costs a hot entry: admitting everything
+ * scores about 0.90 here, the frequency based admission about 0.95.
+ */
+#define SCAN_HOT 900
+
+static void test_scan_resistance(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 1000, NATTRS, apr_time_from_sec(600));
+    mod_vhost_ldap_cache_stats_t st;
+    apr_pool_t *iter;
+    char host[64];
+    int i, hot = 0, hot_hits = 0;
+
+    apr_pool_create(&iter, p);
+    srand(1);
+
+    /* Warm up with the hot set only */
+    for (i = 0; i < SCAN_HOT * 10; i++) {
+	apr_snprintf(host, sizeof(host), "hot%d.example", i % SCAN_HOT);
+	if (!lookup(cache, host, iter))
+	    insert(cache, host);
+    }
+
+    /* Then half of the traffic is scans */
+    for (i = 0; i < 200000; i++) {
+	if (i % 2) {
+	    apr_snprintf(host, sizeof(host), "hot%d.example", rand() % SCAN_HOT);
+	    hot++;
+	}
+	else {
+	    apr_snprintf(host, sizeof(host), "scan%d.example", i);
+	}
+	if (lookup(cache, host, iter)) {
+	    if (host[0] == 'h')
+		hot_hits++;
+	}
+	else {
+	    insert(cache, host);
+	}
+	if (i % 1000 == 0)
+	    apr_pool_clear(iter);
+    }
+
+    fprintf(stderr, "scan resistance: hot hit ratio %.3f\n", (double)hot_hits / hot);
+    CHECK((double)hot_hits / hot > 0.93);
+
+    /* Most scans never made it past the window */
+    mod_vhost_ldap_cache_stats(cache, &st);
+    CHECK(st.rejected > 50000);
+    apr_pool_destroy(iter);
+}
+
+#if APR_HAS_THREADS
+#define THREADS 8
+#define THREAD_OPS 50000
+
+static void *APR_THREAD_FUNC hammer(apr_thread_t *thd, void *data)
+{
+    mod_vhost_ldap_cache_t *cache = data;
+    apr_pool_t *p;
+    char host[64];
+    unsigned int seed = (unsigned int)(apr_uintptr_t)thd;
+    int i;
+
+    apr_pool_create(&p, NULL);
+    for (i = 0; i < THREAD_OPS; i++) {
+	seed = seed * 1103515245 + 12345;
+	apr_snprintf(host, sizeof(host), "h%u.example", (seed >> 16) % 3000);
+	if (!lookup(cache, host, p))
+	    insert(cache, host);
+	if (i % 1000 == 0)
+	    apr_pool_clear(p);
+    }
+    apr_pool_destroy(p);
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
+}
+
+/* Concurrent lookups and inserts keep the counters and bounds consistent */
+static void test_threads(apr_pool_t *p)
+{
+    mod_vhost_ldap_cache_t *cache = mod_vhost_ldap_cache_create(p, 1000, NATTRS, apr_time_from_sec(60));
+    apr_thread_t *threads[THREADS];
+    mod_vhost_ldap_cache_stats_t st;
+    apr_status_t rv;
+    int i;
+
+    for (i = 0; i < THREADS; i++)
+	CHECK(apr_thread_create(&threads[i], NULL, hammer, cache, p) == APR_SUCCESS);
+    for (i = 0; i < THREADS; i++)
+	apr_thread_join(&rv, threads[i]);
+
+    mod_vhost_ldap_cache_stats(cache, &st);
+    CHECK(st.hits + st.misses == (apr_uint64_t)THREADS * THREAD_OPS);
+    CHECK(st.entries <= 1000);
+}
+#endif
+
+int main(void)
+{
+    apr_pool_t *p;
+
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&p, NULL);
+
+    test_roundtrip(p);
+    test_replace(p);
+    test_expiry(p);
+    test_bounded(p);
+    test_admission(p);
+    test_touch(p);
+    test_touch_no_aging(p);
+    test_scan_resistance(p);
+#if APR_HAS_THREADS
+    test_threads(p);
+#endif
+
+    apr_pool_destroy(p);
+
+    if (failures) {
+	fprintf(stderr, "cache_test: %d check(s) failed\n", failures);
+	return 1;
+    }
+    fprintf(stderr, "cache_test: all tests passed\n");
+    return 0;
+}
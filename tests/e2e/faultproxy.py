@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+"""
+faultproxy.py --- TCP proxy between httpd and slapd that injects faults
+
+Listens on --listen and forwards to --target.  Faults are changed at run
+time through --control, one command per line:
+
+  latency <ms>   delay every chunk forwarded in either direction
+  drop <p>       close a connection with probability p on every chunk
+  down           refuse new connections and close existing ones
+  up             accept connections again
+  reset          close all existing connections
+  clear          latency 0, drop 0, up
+  stats          reply with connections accepted/dropped, chunks seen, and
+                 the LDAP bind and search requests forwarded to the server
+
+The request counts are what the directory actually served, whatever
+mod_ldap answered from its own caches.
+"""
+
+import argparse
+import asyncio
+import random
+
+LDAP_BIND_REQUEST = 0x60       # [APPLICATION 0]
+LDAP_SEARCH_REQUEST = 0x63     # [APPLICATION 3]
+
+
+class LdapRequests:
+    """Splits a client to server byte stream into LDAPMessages and tells
+    their protocolOp; only needs the BER tag and length encoding."""
+
+    def __init__(self):
+        self.buf = b""
+
+    @staticmethod
+    def header(buf, pos):
+        # Returns (tag, content start, content length) or None if incomplete
+        if len(buf) < pos + 2:
+            return None
+        tag, n = buf[pos], buf[pos + 1]
+        pos += 2
+        if n & 0x80:
+            k = n & 0x7f
+            if len(buf) < pos + k:
+                return None
+            n = int.from_bytes(buf[pos:pos + k], "big")
+            pos += k
+        return tag, pos, n
+
+    def feed(self, data):
+        """Returns the protocolOp tags of the messages completed by data"""
+        self.buf += data
+        ops = []
+        while True:
+            outer = self.header(self.buf, 0)
+            if outer is None or len(self.buf) < outer[1] + outer[2]:
+                break
+            end = outer[1] + outer[2]
+            msgid = self.header(self.buf, outer[1])
+            if outer[0] == 0x30 and msgid and msgid[1] + msgid[2] < end:
+                ops.append(self.buf[msgid[1] + msgid[2]])
+            self.buf = self.buf[end:]
+        return ops
+
+
+class Proxy:
+    def __init__(self, target_host, target_port):
+        self.target_host = target_host
+        self.target_port = target_port
+        self.latency = 0.0
+        self.drop = 0.0
+        self.down = False
+        self.writers = set()
+        self.accepted = 0
+        self.refused = 0
+        self.dropped = 0
+        self.chunks = 0
+        self.binds = 0
+        self.searches = 0
+
+    def close_all(self):
+        for w in list(self.writers):
+            w.close()
+        self.writers.clear()
+
+    async def pipe(self, reader, writer, peer, requests=None):
+        try:
+            while True:
+                data = await reader.read(65536)
+                if not data:
+                    break
+                self.chunks += 1
+                if self.latency:
+                    await asyncio.sleep(self.latency)
+                if self.drop and random.random() < self.drop:
+                    self.dropped += 1
+                    break
+                writer.write(data)
+                await writer.drain()
+                if requests:
+                    for op in requests.feed(data):
+                        self.binds += op == LDAP_BIND_REQUEST
+                        self.searches += op == LDAP_SEARCH_REQUEST
+        except (ConnectionError, asyncio.CancelledError):
+            pass
+        finally:
+            writer.close()
+            peer.close()
+            self.writers.discard(writer)
+            self.writers.discard(peer)
+
+    async def client(self, reader, writer):
+        if self.down:
+            self.refused += 1
+            writer.close()
+            return
+        try:
+            treader, twriter = await asyncio.open_connection(self.target_host, self.target_port)
+        except OSError:
+            self.refused += 1
+            writer.close()
+            return
+        self.accepted += 1
+        self.writers.update((writer, twriter))
+        await asyncio.gather(self.pipe(reader, twriter, writer, LdapRequests()),
+                             self.pipe(treader, writer, twriter))
+
+    async def control(self, reader, writer):
+        while True:
+            line = await reader.readline()
+            if not line:
+                break
+            cmd = line.decode().split()
+            reply = "ok"
+            if not cmd:
+                continue
+            elif cmd[0] == "latency":
+                self.latency = float(cmd[1]) / 1000.0
+            elif cmd[0] == "drop":
+                self.drop = float(cmd[1])
+            elif cmd[0] == "down":
+                self.down = True
+                self.close_all()
+            elif cmd[0] == "up":
+                self.down = False
+            elif cmd[0] == "reset":
+                self.close_all()
+            elif cmd[0] == "clear":
+                self.latency, self.drop, self.down = 0.0, 0.0, False
+            elif cmd[0] == "stats":
+                reply = "accepted=%d refused=%d dropped=%d chunks=%d binds=%d searches=%d" % (
+                    self.accepted, self.refused, self.dropped, self.chunks,
+                    self.binds, self.searches)
+            else:
+                reply = "error: unknown command"
+            writer.write((reply + "\n").encode())
+            await writer.drain()
+        writer.close()
+
+
+def hostport(s):
+    host, port = s.rsplit(":", 1)
+    return host, int(port)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--listen", type=hostport, required=True)
+    parser.add_argument("--target", type=hostport, required=True)
+    parser.add_argument("--control", type=hostport, required=True)
+    args = parser.parse_args()
+
+    proxy = Proxy(*args.target)
+    server = await asyncio.start_server(proxy.client, *args.listen)
+    control = await asyncio.start_server(proxy.control, *args.control)
+    async with server, control:
+        await asyncio.gather(server.serve_forever(), control.serve_forever())
+
+
+if __name__ == "__main__":
+    asyncio.run(main())
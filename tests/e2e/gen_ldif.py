@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""
+gen_ldif.py --- generate a vhost dataset for the end-to-end tests
+
+For N vhosts this writes one apacheConfig entry per vhost:
+
+  vhost<i>.example.test        exact apacheServerName
+  alias<i>.example.test        apacheServerAlias of vhost<i>
+  *.wild<i>.example.test       wildcard entry, for every 10th i
+  fallback.example.test        the VhostLDAPFallback target
+
+Each class gets its own DocumentRoot, holding an index.html naming the
+class, so the load generator can check requests landed on the right vhost.
+"""
+
+import argparse
+import sys
+
+WILDCARD_EVERY = 10
+
+
+def entry(out, basedn, name, docroot, aliases=()):
+    out.write("dn: apacheServerName=%s,%s\n" % (name, basedn))
+    out.write("objectClass: apacheConfig\n")
+    out.write("apacheServerName: %s\n" % name)
+    for alias in aliases:
+        out.write("apacheServerAlias: %s\n" % alias)
+    out.write("apacheDocumentRoot: %s\n" % docroot)
+    out.write("apacheServerAdmin: webmaster@%s\n\n" % name.lstrip("*."))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-n", "--vhosts", type=int, default=1000)
+    parser.add_argument("--suffix", default="dc=example,dc=test")
+    parser.add_argument("--htdocs", required=True,
+                        help="directory holding the exact/wildcard/fallback docroots")
+    args = parser.parse_args()
+
+    out = sys.stdout
+    basedn = "ou=vhosts," + args.suffix
+
+    out.write("dn: %s\nobjectClass: dcObject\nobjectClass: organization\n"
+              "dc: %s\no: mod_vhost_ldap tests\n\n"
+              % (args.suffix, args.suffix.split(",")[0].split("=")[1]))
+    out.write("dn: %s\nobjectClass: organizationalUnit\nou: vhosts\n\n" % basedn)
+
+    for i in range(args.vhosts):
+        entry(out, basedn, "vhost%d.example.test" % i, args.htdocs + "/exact",
+              aliases=["alias%d.example.test" % i])
+        if i % WILDCARD_EVERY == 0:
+            entry(out, basedn, "*.wild%d.example.test" % i, args.htdocs + "/wildcard")
+
+    entry(out, basedn, "fallback.example.test", args.htdocs + "/fallback")
+
+
+if __name__ == "__main__":
+    main()
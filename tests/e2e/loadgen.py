@@ -0,0 +1,247 @@
+#!/usr/bin/env python3
+"""
+loadgen.py --- load generator and report for the end-to-end tests
+
+Sends GET / with a Host: header picked from the gen_ldif.py dataset for
+--duration seconds from --concurrency threads, and checks that every
+response came from the right class of vhost (exact, alias, wildcard,
+fallback).  Hostnames are picked with a skew, so some vhosts are hot and
+most are in the long tail; the "scan" class are random names that only
+exist once and resolve to the fallback vhost.
+
+The searches the directory served are counted by faultproxy.py, asked
+through --proxy-control before and after the run.  The access log written
+with the vhost_ldap_e2e LogFormat adds the module's view: getuserdn calls
+(which mod_ldap may answer from its own cache), cache hits, and connect
+and search times.  The result is printed as one JSON object, and compared
+with --baseline if given.
+"""
+
+import argparse
+import http.client
+import json
+import random
+import socket
+import sys
+import threading
+import time
+
+CLASSES = ("exact", "alias", "wildcard", "fallback", "scan")
+WILDCARD_EVERY = 10
+
+# Fields of the vhost_ldap_e2e LogFormat written by run.sh
+LOG_FIELDS = ("host", "status", "usec", "total", "connect", "search", "retry", "docroot",
+              "searches", "retries", "wildcard", "fallback", "cache")
+
+
+def pick_host(rnd, cls, vhosts, seq):
+    # Skewed towards low indexes: a few hot vhosts and a long tail
+    i = int(vhosts * rnd.random() ** 3)
+    if cls == "exact":
+        return "vhost%d.example.test" % i, "exact"
+    if cls == "alias":
+        return "alias%d.example.test" % i, "exact"
+    if cls == "wildcard":
+        w = (i // WILDCARD_EVERY) * WILDCARD_EVERY
+        return "www%d.wild%d.example.test" % (i % 5, w), "wildcard"
+    if cls == "fallback":
+        return "missing%d.example.test" % (i % 50), "fallback"
+    return "scan-%d-%d.example.test" % (seq, rnd.randrange(1 << 30)), "fallback"
+
+
+class Worker(threading.Thread):
+    def __init__(self, args, weights, deadline, seed):
+        super().__init__(daemon=True)
+        self.args = args
+        self.weights = weights
+        self.deadline = deadline
+        self.rnd = random.Random(seed)
+        self.latencies = []
+        self.errors = 0
+        self.wrong = 0
+        self.statuses = {}
+
+    def run(self):
+        host, port = self.args.target.rsplit(":", 1)
+        conn = None
+        seq = 0
+        while time.monotonic() < self.deadline:
+            seq += 1
+            cls = self.rnd.choices(CLASSES, self.weights)[0]
+            vhost, expect = pick_host(self.rnd, cls, self.args.vhosts, seq)
+            start = time.monotonic()
+            try:
+                if conn is None:
+                    conn = http.client.HTTPConnection(host, int(port), timeout=self.args.timeout)
+                conn.request("GET", "/", headers={"Host": vhost})
+                resp = conn.getresponse()
+                body = resp.read().decode(errors="replace")
+            except (OSError, http.client.HTTPException):
+                self.errors += 1
+                if conn is not None:
+                    conn.close()
+                conn = None
+                continue
+            self.latencies.append(time.monotonic() - start)
+            self.statuses[resp.status] = self.statuses.get(resp.status, 0) + 1
+            if resp.status == 200 and body.strip() != expect:
+                self.wrong += 1
+            if resp.will_close:
+                conn.close()
+                conn = None
+        if conn is not None:
+            conn.close()
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    k = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[k]
+
+
+def read_access_log(path):
+    requests = searches = retries = hits = misses = wildcard = fallback = 0
+    connect_usec = search_usec = total_usec = 0
+    try:
+        f = open(path)
+    except OSError:
+        return {}
+    with f:
+        for line in f:
+            fields = dict(zip(LOG_FIELDS, line.split()))
+            if len(fields) < len(LOG_FIELDS):
+                continue
+
+            def num(name):
+                try:
+                    return int(fields[name])
+                except ValueError:
+                    return 0
+
+            requests += 1
+            searches += num("searches")
+            retries += num("retries")
+            connect_usec += num("connect")
+            search_usec += num("search")
+            total_usec += num("total")
+            wildcard += num("wildcard") > 0
+            fallback += num("fallback")
+            hits += fields["cache"] == "hit"
+            misses += fields["cache"] == "miss"
+    if not requests:
+        return {}
+    return {
+        "logged_requests": requests,
+        "getuserdn_calls": searches,
+        "getuserdn_per_request": round(searches / requests, 4),
+        "ldap_retries": retries,
+        "cache_hit_ratio": round(hits / (hits + misses), 4) if hits + misses else None,
+        "mean_connect_ms": round(connect_usec / requests / 1000.0, 3),
+        "mean_search_ms": round(search_usec / requests / 1000.0, 3),
+        "mean_vhost_ms": round(total_usec / requests / 1000.0, 3),
+        "wildcard_requests": wildcard,
+        "fallback_requests": fallback,
+    }
+
+
+def proxy_stats(control):
+    host, port = control.rsplit(":", 1)
+    with socket.create_connection((host, int(port)), 5) as s:
+        s.sendall(b"stats\n")
+        reply = s.makefile().readline().split()
+    return dict((k, int(v)) for k, v in (f.split("=") for f in reply))
+
+
+def compare(result, baseline):
+    keys = ("throughput", "p50_ms", "p90_ms", "p99_ms", "searches_per_request", "cache_hit_ratio")
+    lines = []
+    for k in keys:
+        a, b = baseline.get(k), result.get(k)
+        if a is None or b is None:
+            continue
+        delta = ("%+.1f%%" % (100.0 * (b - a) / a)) if a else "n/a"
+        lines.append("  %-22s %12s -> %-12s %s" % (k, a, b, delta))
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--target", default="127.0.0.1:8080", help="httpd host:port")
+    parser.add_argument("--scenario", default="baseline")
+    parser.add_argument("-n", "--vhosts", type=int, default=1000)
+    parser.add_argument("-d", "--duration", type=float, default=30)
+    parser.add_argument("-c", "--concurrency", type=int, default=16)
+    parser.add_argument("--timeout", type=float, default=30)
+    parser.add_argument("--mix", default="50,20,15,5,10",
+                        help="weights of " + ",".join(CLASSES))
+    parser.add_argument("--access-log", help="access log written with the vhost_ldap_e2e format")
+    parser.add_argument("--proxy-control", help="faultproxy.py control host:port, to count "
+                        "the searches that reached the directory")
+    parser.add_argument("--baseline", help="JSON lines file of earlier results to compare with")
+    args = parser.parse_args()
+
+    weights = [float(w) for w in args.mix.split(",")]
+    if len(weights) != len(CLASSES):
+        parser.error("--mix needs %d weights" % len(CLASSES))
+
+    before = proxy_stats(args.proxy_control) if args.proxy_control else None
+    deadline = time.monotonic() + args.duration
+    workers = [Worker(args, weights, deadline, seed) for seed in range(args.concurrency)]
+    start = time.monotonic()
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    elapsed = time.monotonic() - start
+    after = proxy_stats(args.proxy_control) if args.proxy_control else None
+
+    latencies = sorted(l for w in workers for l in w.latencies)
+    statuses = {}
+    for w in workers:
+        for status, n in w.statuses.items():
+            statuses[str(status)] = statuses.get(str(status), 0) + n
+
+    result = {
+        "scenario": args.scenario,
+        "vhosts": args.vhosts,
+        "concurrency": args.concurrency,
+        "duration": round(elapsed, 2),
+        "requests": len(latencies),
+        "throughput": round(len(latencies) / elapsed, 1),
+        "p50_ms": round(percentile(latencies, 50) * 1000, 2),
+        "p90_ms": round(percentile(latencies, 90) * 1000, 2),
+        "p99_ms": round(percentile(latencies, 99) * 1000, 2),
+        "max_ms": round((latencies[-1] if latencies else 0) * 1000, 2),
+        "errors": sum(w.errors for w in workers),
+        "wrong_vhost": sum(w.wrong for w in workers),
+        "statuses": statuses,
+    }
+    if after:
+        searches = after["searches"] - before["searches"]
+        result["directory_searches"] = searches
+        result["directory_binds"] = after["binds"] - before["binds"]
+        result["searches_per_request"] = round(searches / len(latencies), 4) if latencies else None
+    if args.access_log:
+        result.update(read_access_log(args.access_log))
+
+    print(json.dumps(result, sort_keys=True))
+
+    if args.baseline:
+        try:
+            with open(args.baseline) as f:
+                for line in f:
+                    base = json.loads(line)
+                    if base.get("scenario") == args.scenario:
+                        print("%s vs baseline:\n%s" % (args.scenario, compare(result, base)),
+                              file=sys.stderr)
+                        break
+        except (OSError, ValueError) as e:
+            print("cannot read baseline %s: %s" % (args.baseline, e), file=sys.stderr)
+
+    return 1 if result["wrong_vhost"] else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
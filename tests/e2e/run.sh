@@ -0,0 +1,260 @@
+#!/bin/sh
+#
+# run.sh --- end-to-end load and fault-injection test of mod_vhost_ldap
+#
+# Starts a throwaway slapd loaded with mod_vhost_ldap.schema and a
+# generated set of vhosts, puts faultproxy.py between it and a throwaway
+# httpd running the module, and runs loadgen.py once per scenario:
+#
+#   baseline   no faults
+#   latency    LATENCY_MS (20) added by the proxy to every LDAP packet
+#   drop       LDAP connections dropped with probability DROP_P (0.02) per packet
+#   restart    directory down for RESTART_DOWN (3) seconds a third into the run
+#   scan       half of the requests are random, never repeated hostnames
+#
+# Usage: tests/e2e/run.sh [scenario...]
+#
+# One JSON line per scenario (throughput, latency percentiles, searches
+# per request that reached slapd as counted by the proxy, cache hit
+# ratio, ...) is appended to RESULTS.  mod_ldap's own cache (LDAP_CACHE)
+# answers part of the module's lookups, so set LDAP_CACHE=0 to measure
+# the module alone.
+# Pass an earlier results file as BASELINE to print the differences.
+#
+# Environment: APXS, HTTPD, SLAPD, SLAPADD, VHOSTS (1000), DURATION (30),
+# CONCURRENCY (16), CACHE_ENTRIES (0), LDAP_CACHE (1024, mod_ldap's
+# LDAPCacheEntries), PORT_BASE (18000), RESULTS, BASELINE, KEEP (keep the
+# work directory).
+#
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+TOP=$(cd "$HERE/../.." && pwd)
+
+APXS=${APXS:-apxs2}
+VHOSTS=${VHOSTS:-1000}
+DURATION=${DURATION:-30}
+CONCURRENCY=${CONCURRENCY:-16}
+CACHE_ENTRIES=${CACHE_ENTRIES:-0}
+LDAP_CACHE=${LDAP_CACHE:-1024}
+PORT_BASE=${PORT_BASE:-18000}
+RESULTS=${RESULTS:-$HERE/results-$(date +%Y%m%d-%H%M%S).jsonl}
+
+HTTP_PORT=$((PORT_BASE + 80))
+LDAP_PORT=$((PORT_BASE + 389))
+PROXY_PORT=$((PORT_BASE + 390))
+CONTROL_PORT=$((PORT_BASE + 391))
+
+SUFFIX="dc=example,dc=test"
+
+SCENARIOS=${*:-baseline latency drop restart scan}
+
+die() {
+    echo "run.sh: $*" >&2
+    exit 1
+}
+
+find_prog() {
+    for p in "$@"; do
+	if command -v "$p" >/dev/null 2>&1; then
+	    command -v "$p"
+	    return
+	fi
+	if [ -x "$p" ]; then
+	    echo "$p"
+	    return
+	fi
+    done
+}
+
+HTTPD=${HTTPD:-$(find_prog "$($APXS -q SBINDIR 2>/dev/null)/$($APXS -q PROGNAME 2>/dev/null)" apache2 httpd)}
+SLAPD=${SLAPD:-$(find_prog slapd /usr/sbin/slapd /usr/libexec/slapd /usr/local/libexec/slapd)}
+SLAPADD=${SLAPADD:-$(find_prog slapadd /usr/sbin/slapadd /usr/local/sbin/slapadd)}
+
+[ -n "$HTTPD" ] || die "httpd not found, set HTTPD"
+[ -n "$SLAPD" ] || die "slapd not found, set SLAPD"
+[ -n "$SLAPADD" ] || die "slapadd not found, set SLAPADD"
+command -v python3 >/dev/null 2>&1 || die "python3 not found"
+
+MODDIR=$($APXS -q LIBEXECDIR) || die "$APXS not working, set APXS"
+
+WORK=$(mktemp -d /tmp/mod-vhost-ldap-e2e.XXXXXXXX)
+SLAPD_PID=
+PROXY_PID=
+
+cleanup() {
+    [ -f "$WORK/httpd.pid" ] && "$HTTPD" -f "$WORK/httpd.conf" -k stop 2>/dev/null || true
+    [ -n "$PROXY_PID" ] && kill "$PROXY_PID" 2>/dev/null || true
+    [ -n "$SLAPD_PID" ] && kill "$SLAPD_PID" 2>/dev/null || true
+    if [ -n "$KEEP" ]; then
+	echo "run.sh: work directory kept in $WORK" >&2
+    else
+	rm -rf "$WORK"
+    fi
+}
+trap cleanup EXIT INT TERM
+
+wait_port() {
+    python3 - "$1" <<'EOF'
+import socket, sys, time
+for _ in range(100):
+    try:
+        socket.create_connection(("127.0.0.1", int(sys.argv[1])), 0.2).close()
+        sys.exit(0)
+    except OSError:
+        time.sleep(0.1)
+sys.exit(1)
+EOF
+}
+
+control() {
+    python3 - "$CONTROL_PORT" "$*" <<'EOF'
+import socket, sys
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.sendall((sys.argv[2] + "\n").encode())
+print(s.makefile().readline().strip())
+EOF
+}
+
+# --- module -----------------------------------------------------------------
+
+make -C "$TOP" APXS="$APXS" >"$WORK/build.log" 2>&1 || die "module build failed, see $WORK/build.log"
+
+# --- slapd ------------------------------------------------------------------
+
+for d in /etc/ldap/schema /etc/openldap/schema /usr/local/etc/openldap/schema; do
+    [ -f "$d/core.schema" ] && SCHEMA_DIR=$d && break
+done
+[ -n "$SCHEMA_DIR" ] || die "OpenLDAP core.schema not found"
+
+mkdir -p "$WORK/ldap" "$WORK/htdocs/exact" "$WORK/htdocs/wildcard" "$WORK/htdocs/fallback" "$WORK/logs"
+for class in exact wildcard fallback; do
+    echo "$class" >"$WORK/htdocs/$class/index.html"
+done
+
+{
+    for d in /usr/lib/ldap /usr/lib64/openldap /usr/lib/openldap /usr/local/libexec/openldap; do
+	if ls "$d"/back_mdb* >/dev/null 2>&1; then
+	    echo "modulepath $d"
+	    echo "moduleload back_mdb"
+	    break
+	fi
+    done
+    cat <<EOF
+include $SCHEMA_DIR/core.schema
+include $TOP/mod_vhost_ldap.schema
+pidfile $WORK/slapd.pid
+database mdb
+maxsize 1073741824
+suffix "$SUFFIX"
+rootdn "cn=admin,$SUFFIX"
+rootpw secret
+directory $WORK/ldap
+index objectClass eq
+index apacheServerName,apacheServerAlias eq
+EOF
+} >"$WORK/slapd.conf"
+
+python3 "$HERE/gen_ldif.py" -n "$VHOSTS" --suffix "$SUFFIX" --htdocs "$WORK/htdocs" >"$WORK/vhosts.ldif"
+"$SLAPADD" -q -f "$WORK/slapd.conf" -l "$WORK/vhosts.ldif" || die "slapadd failed"
+
+"$SLAPD" -f "$WORK/slapd.conf" -h "ldap://127.0.0.1:$LDAP_PORT/" -d 0 >"$WORK/logs/slapd.log" 2>&1 &
+SLAPD_PID=$!
+wait_port "$LDAP_PORT" || die "slapd did not start, see $WORK/logs/slapd.log"
+
+python3 "$HERE/faultproxy.py" --listen "127.0.0.1:$PROXY_PORT" \
+    --target "127.0.0.1:$LDAP_PORT" --control "127.0.0.1:$CONTROL_PORT" &
+PROXY_PID=$!
+wait_port "$CONTROL_PORT" || die "faultproxy did not start"
+
+# --- httpd ------------------------------------------------------------------
+
+load() {
+    [ -f "$MODDIR/$2" ] && echo "LoadModule $1 $MODDIR/$2"
+    true
+}
+
+{
+    load mpm_event_module mod_mpm_event.so
+    load unixd_module mod_unixd.so
+    load authz_core_module mod_authz_core.so
+    load log_config_module mod_log_config.so
+    load mime_module mod_mime.so
+    load dir_module mod_dir.so
+    load ldap_module mod_ldap.so
+    cat <<EOF
+LoadModule vhost_ldap_module $TOP/.libs/mod_vhost_ldap.so
+
+ServerRoot $WORK
+ServerName localhost
+Listen 127.0.0.1:$HTTP_PORT
+PidFile $WORK/httpd.pid
+ErrorLog $WORK/logs/error.log
+LogLevel warn vhost_ldap:info
+DocumentRoot $WORK/htdocs
+DirectoryIndex index.html
+<IfModule mpm_event_module>
+    ServerLimit 1
+    ThreadsPerChild $((CONCURRENCY * 2))
+    MaxRequestWorkers $((CONCURRENCY * 2))
+</IfModule>
+
+LDAPCacheEntries $LDAP_CACHE
+LDAPConnectionTimeout 2
+LDAPTimeout 5
+
+<Directory $WORK/htdocs>
+    Require all granted
+</Directory>
+
+LogFormat "%{Host}i %>s %D %{vhost-ldap-time-total}n %{vhost-ldap-time-connect}n %{vhost-ldap-time-search}n %{vhost-ldap-time-retry}n %{vhost-ldap-time-docroot}n %{vhost-ldap-searches}n %{vhost-ldap-retries}n %{vhost-ldap-wildcard}n %{vhost-ldap-fallback}n %{vhost-ldap-cache}n" vhost_ldap_e2e
+CustomLog \${E2E_ACCESS_LOG} vhost_ldap_e2e
+
+VhostLDAPEnabled on
+VhostLDAPUrl "ldap://127.0.0.1:$PROXY_PORT/ou=vhosts,$SUFFIX"
+VhostLDAPFallback fallback.example.test
+VhostLDAPWildcard on
+VhostLDAPCacheEntries $CACHE_ENTRIES
+EOF
+} >"$WORK/httpd.conf"
+
+# --- scenarios --------------------------------------------------------------
+
+echo "run.sh: $VHOSTS vhosts, $CONCURRENCY clients, ${DURATION}s per scenario, results in $RESULTS" >&2
+
+for scenario in $SCENARIOS; do
+    mix="50,20,15,5,10"
+    fault_pid=
+
+    control clear >/dev/null
+    access_log="$WORK/logs/access_$scenario.log"
+    E2E_ACCESS_LOG=$access_log "$HTTPD" -f "$WORK/httpd.conf" -k start
+    wait_port "$HTTP_PORT" || die "httpd did not start, see $WORK/logs/error.log"
+
+    case $scenario in
+	baseline) ;;
+	latency) control latency "${LATENCY_MS:-20}" >/dev/null ;;
+	drop)    control drop "${DROP_P:-0.02}" >/dev/null ;;
+	restart)
+	    (sleep $((DURATION / 3)); control down >/dev/null;
+	     sleep "${RESTART_DOWN:-3}"; control up >/dev/null) &
+	    fault_pid=$!
+	    ;;
+	scan)    mix="25,10,10,5,50" ;;
+	*)       die "unknown scenario $scenario" ;;
+    esac
+
+    python3 "$HERE/loadgen.py" --target "127.0.0.1:$HTTP_PORT" --scenario "$scenario" \
+	-n "$VHOSTS" -d "$DURATION" -c "$CONCURRENCY" --mix "$mix" \
+	--access-log "$access_log" --proxy-control "127.0.0.1:$CONTROL_PORT" ${BASELINE:+--baseline "$BASELINE"} >>"$RESULTS" || \
+	echo "run.sh: $scenario: requests were served by the wrong vhost" >&2
+
+    [ -n "$fault_pid" ] && wait "$fault_pid"
+    echo "run.sh: $scenario: proxy $(control stats)" >&2
+
+    "$HTTPD" -f "$WORK/httpd.conf" -k stop
+    while [ -f "$WORK/httpd.pid" ]; do sleep 0.2; done
+    grep "cache:" "$WORK/logs/error.log" | tail -n 1 | sed "s/^/run.sh: $scenario: /" >&2 || true
+    tail -n 1 "$RESULTS"
+done
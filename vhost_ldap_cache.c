@@ -0,0 +1,499 @@
+/* ============================================================
+ * Copyright (c) 2003-2004, Ondrej Sury
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * vhost_ldap_cache.c --- bounded W-TinyLFU cache of resolved virtual hosts
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr_strings.h"
+#include "apr_thread_mutex.h"
+
+#include "vhost_ldap_cache.h"
+
+#define CACHE_MAX_SHARDS	16
+#define CACHE_MIN_SHARD_SIZE	64
+#define CACHE_SKETCH_DEPTH	4
+#define CACHE_SKETCH_MAX	MOD_VHOST_LDAP_CACHE_MAX_FREQUENCY	/* Counters saturate at this value */
+#define CACHE_SAMPLE_FACTOR	10	/* Age the sketch every 10 * capacity increments */
+
+typedef struct mod_vhost_ldap_cache_queue_t mod_vhost_ldap_cache_queue_t;
+
+typedef struct mod_vhost_ldap_cache_node_t {
+    struct mod_vhost_ldap_cache_node_t *hnext;	/* Hash chain */
+    struct mod_vhost_ldap_cache_node_t *prev;	/* Queue links */
+    struct mod_vhost_ldap_cache_node_t *next;
+    mod_vhost_ldap_cache_queue_t *queue;	/* Queue the node is on */
+    apr_uint32_t hash;
+    apr_time_t expires;
+    char *key;					/* Requested hostname */
+    char *dn;
+    char **vals;				/* One value per search attribute */
+    int wildcard;				/* Wildcard levels tried by the lookup */
+    int fallback;				/* Set if resolved to the fallback vhost */
+} mod_vhost_ldap_cache_node_t;
+
+struct mod_vhost_ldap_cache_queue_t {
+    mod_vhost_ldap_cache_node_t head;	/* Sentinel, head.next is the most recently used */
+    int size;
+    int capacity;
+};
+
+typedef struct mod_vhost_ldap_cache_shard_t {
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    mod_vhost_ldap_cache_node_t **buckets;
+    apr_uint32_t bucket_mask;
+
+    mod_vhost_ldap_cache_queue_t window;	/* Admission window (LRU) */
+    mod_vhost_ldap_cache_queue_t probation;	/* Main segment, seen once in main */
+    mod_vhost_ldap_cache_queue_t protected;	/* Main segment, hit again in main */
+    int main_capacity;
+
+    unsigned char *sketch;			/* CACHE_SKETCH_DEPTH rows of 4-bit counters, two per byte */
+    apr_uint32_t sketch_mask;
+    int additions;
+    int sample_size;
+
+    apr_uint64_t hits;
+    apr_uint64_t misses;
+    apr_uint64_t admitted;
+    apr_uint64_t rejected;
+    apr_uint64_t evicted;
+    apr_uint64_t expired;
+} mod_vhost_ldap_cache_shard_t;
+
+struct mod_vhost_ldap_cache_t {
+    mod_vhost_ldap_cache_shard_t *shards;
+    apr_uint32_t shard_mask;
+    int nattrs;				/* Number of values per entry */
+    apr_interval_time_t ttl;
+};
+
+static const apr_uint32_t cache_sketch_seeds[CACHE_SKETCH_DEPTH] =
+  { 0x97cb3127U, 0xb492b66fU, 0x9ae16a3bU, 0xcbf29ce5U };
+
+/* FNV-1a with the murmur3 finalizer, so that all bits are usable */
+static apr_uint32_t mod_vhost_ldap_cache_hash(const char *key)
+{
+    apr_uint32_t h = 2166136261U;
+
+    for (; *key; key++) {
+	h ^= (unsigned char)*key;
+	h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static apr_uint32_t mod_vhost_ldap_cache_pow2(apr_uint32_t n)
+{
+    apr_uint32_t p = 1;
+
+    while (p < n)
+	p <<= 1;
+    return p;
+}
+
+/* Index of the counter for hash in the given row */
+static APR_INLINE apr_uint32_t
+mod_vhost_ldap_sketch_index(mod_vhost_ldap_cache_shard_t *shard, apr_uint32_t hash, int row)
+{
+    apr_uint32_t x = hash * cache_sketch_seeds[row];
+
+    x ^= x >> 15;
+    return row * (shard->sketch_mask + 1) + (x & shard->sketch_mask);
+}
+
+static APR_INLINE int mod_vhost_ldap_sketch_get(mod_vhost_ldap_cache_shard_t *shard, apr_uint32_t i)
+{
+    return (shard->sketch[i >> 1] >> ((i & 1) << 2)) & 0x0f;
+}
+
+static int mod_vhost_ldap_sketch_frequency(mod_vhost_ldap_cache_shard_t *shard, apr_uint32_t hash)
+{
+    int row, c, freq = CACHE_SKETCH_MAX;
+
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+	c = mod_vhost_ldap_sketch_get(shard, mod_vhost_ldap_sketch_index(shard, hash, row));
+	if (c < freq)
+	    freq = c;
+    }
+    return freq;
+}
+
+/* Returns whether any counter was still below the maximum */
+static int mod_vhost_ldap_sketch_add(mod_vhost_ldap_cache_shard_t *shard, apr_uint32_t hash)
+{
+    int row, added = 0;
+    apr_uint32_t i;
+
+    for (row = 0; row < CACHE_SKETCH_DEPTH; row++) {
+	i = mod_vhost_ldap_sketch_index(shard, hash, row);
+	if (mod_vhost_ldap_sketch_get(shard, i) < CACHE_SKETCH_MAX) {
+	    shard->sketch[i >> 1] += 1 << ((i & 1) << 2);
+	    added = 1;
+	}
+    }
+    return added;
+}
+
+static void mod_vhost_ldap_sketch_increment(mod_vhost_ldap_cache_shard_t *shard, apr_uint32_t hash)
+{
+    apr_uint32_t i, n;
+
+    /* Halve all counters periodically, so that old popularity fades out */
+    if (mod_vhost_ldap_sketch_add(shard, hash) && ++shard->additions >= shard->sample_size) {
+	n = CACHE_SKETCH_DEPTH * (shard->sketch_mask + 1) / 2;
+	for (i = 0; i < n; i++)
+	    shard->sketch[i] = (shard->sketch[i] >> 1) & 0x77;
+	shard->additions /= 2;
+    }
+}
+
+static void mod_vhost_ldap_queue_init(mod_vhost_ldap_cache_queue_t *q, int capacity)
+{
+    q->head.prev = q->head.next = &q->head;
+    q->size = 0;
+    q->capacity = capacity;
+}
+
+static void mod_vhost_ldap_queue_push(mod_vhost_ldap_cache_queue_t *q, mod_vhost_ldap_cache_node_t *node)
+{
+    node->prev = &q->head;
+    node->next = q->head.next;
+    q->head.next->prev = node;
+    q->head.next = node;
+    node->queue = q;
+    q->size++;
+}
+
+static void mod_vhost_ldap_queue_unlink(mod_vhost_ldap_cache_node_t *node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->queue->size--;
+    node->queue = NULL;
+}
+
+static mod_vhost_ldap_cache_node_t *mod_vhost_ldap_queue_lru(mod_vhost_ldap_cache_queue_t *q)
+{
+    return q->size ? q->head.prev : NULL;
+}
+
+static mod_vhost_ldap_cache_node_t *
+mod_vhost_ldap_cache_find(mod_vhost_ldap_cache_shard_t *shard, apr_uint32_t hash, const char *key)
+{
+    mod_vhost_ldap_cache_node_t *node;
+
+    for (node = shard->buckets[hash & shard->bucket_mask]; node; node = node->hnext) {
+	if (node->hash == hash && strcmp(node->key, key) == 0)
+	    return node;
+    }
+    return NULL;
+}
+
+/* Remove a node from its queue and the hash table and free it */
+static void mod_vhost_ldap_cache_remove(mod_vhost_ldap_cache_shard_t *shard,
+					mod_vhost_ldap_cache_node_t *node)
+{
+    mod_vhost_ldap_cache_node_t **np = &shard->buckets[node->hash & shard->bucket_mask];
+
+    while (*np != node)
+	np = &(*np)->hnext;
+    *np = node->hnext;
+
+    mod_vhost_ldap_queue_unlink(node);
+    free(node);
+}
+
+/* Free all nodes when the pool the cache lives in goes away */
+static apr_status_t mod_vhost_ldap_cache_cleanup(void *data)
+{
+    mod_vhost_ldap_cache_t *cache = data;
+    mod_vhost_ldap_cache_queue_t *queues[3];
+    apr_uint32_t i;
+    int q;
+
+    for (i = 0; i <= cache->shard_mask; i++) {
+	mod_vhost_ldap_cache_shard_t *shard = &cache->shards[i];
+
+	queues[0] = &shard->window;
+	queues[1] = &shard->probation;
+	queues[2] = &shard->protected;
+	for (q = 0; q < 3; q++) {
+	    mod_vhost_ldap_cache_node_t *node, *next;
+
+	    for (node = queues[q]->head.next; node != &queues[q]->head; node = next) {
+		next = node->next;
+		free(node);
+	    }
+	    mod_vhost_ldap_queue_init(queues[q], queues[q]->capacity);
+	}
+	memset(shard->buckets, 0, (shard->bucket_mask + 1) * sizeof(mod_vhost_ldap_cache_node_t *));
+    }
+    return APR_SUCCESS;
+}
+
+mod_vhost_ldap_cache_t *mod_vhost_ldap_cache_create(apr_pool_t *p, int entries, int nattrs,
+						    apr_interval_time_t ttl)
+{
+    mod_vhost_ldap_cache_t *cache = apr_pcalloc(p, sizeof(mod_vhost_ldap_cache_t));
+    apr_uint32_t nshards = 1, i;
+    int capacity, window;
+
+    while (nshards < CACHE_MAX_SHARDS && entries / (int)(nshards * 2) >= CACHE_MIN_SHARD_SIZE)
+	nshards <<= 1;
+
+    capacity = entries / nshards;
+    if (capacity < 1)
+	capacity = 1;
+    window = capacity / 100;
+    if (window < 1)
+	window = 1;
+
+    cache->nattrs = nattrs;
+    cache->ttl = ttl;
+    cache->shard_mask = nshards - 1;
+    cache->shards = apr_pcalloc(p, nshards * sizeof(mod_vhost_ldap_cache_shard_t));
+
+    for (i = 0; i < nshards; i++) {
+	mod_vhost_ldap_cache_shard_t *shard = &cache->shards[i];
+	apr_uint32_t width = mod_vhost_ldap_cache_pow2(capacity);
+
+#if APR_HAS_THREADS
+	apr_thread_mutex_create(&shard->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+	shard->bucket_mask = width - 1;
+	shard->buckets = apr_pcalloc(p, width * sizeof(mod_vhost_ldap_cache_node_t *));
+
+	shard->main_capacity = capacity - window;
+	mod_vhost_ldap_queue_init(&shard->window, window);
+	mod_vhost_ldap_queue_init(&shard->probation, shard->main_capacity);
+	mod_vhost_ldap_queue_init(&shard->protected, shard->main_capacity * 4 / 5);
+
+	/* At least two counters per row, so that rows fill whole bytes */
+	shard->sketch_mask = (width < 2) ? 1 : width - 1;
+	shard->sketch = apr_pcalloc(p, CACHE_SKETCH_DEPTH * (shard->sketch_mask + 1) / 2);
+	shard->sample_size = CACHE_SAMPLE_FACTOR * capacity;
+    }
+
+    apr_pool_cleanup_register(p, cache, mod_vhost_ldap_cache_cleanup, apr_pool_cleanup_null);
+
+    return cache;
+}
+
+static APR_INLINE void mod_vhost_ldap_cache_lock(mod_vhost_ldap_cache_shard_t *shard)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(shard->mutex);
+#endif
+}
+
+static APR_INLINE void mod_vhost_ldap_cache_unlock(mod_vhost_ldap_cache_shard_t *shard)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(shard->mutex);
+#endif
+}
+
+int mod_vhost_ldap_cache_lookup(mod_vhost_ldap_cache_t *cache, const char *hostname,
+				apr_pool_t *p, const char **dn, const char ***vals,
+				int *wildcard, int *fallback)
+{
+    apr_uint32_t hash = mod_vhost_ldap_cache_hash(hostname);
+    mod_vhost_ldap_cache_shard_t *shard = &cache->shards[(hash >> 24) & cache->shard_mask];
+    mod_vhost_ldap_cache_node_t *node;
+    const char **v;
+    int i;
+
+    mod_vhost_ldap_cache_lock(shard);
+
+    /* Every access counts towards popularity, hit or miss */
+    mod_vhost_ldap_sketch_increment(shard, hash);
+
+    node = mod_vhost_ldap_cache_find(shard, hash, hostname);
+    if (node && node->expires < apr_time_now()) {
+	mod_vhost_ldap_cache_remove(shard, node);
+	shard->expired++;
+	node = NULL;
+    }
+    if (node == NULL) {
+	shard->misses++;
+	mod_vhost_ldap_cache_unlock(shard);
+	return 0;
+    }
+
+    shard->hits++;
+    if (node->queue == &shard->probation) {
+	/* Hit in probation: promote, demoting the protected LRU if needed */
+	mod_vhost_ldap_queue_unlink(node);
+	mod_vhost_ldap_queue_push(&shard->protected, node);
+	if (shard->protected.size > shard->protected.capacity) {
+	    mod_vhost_ldap_cache_node_t *demoted = mod_vhost_ldap_queue_lru(&shard->protected);
+	    mod_vhost_ldap_queue_unlink(demoted);
+	    mod_vhost_ldap_queue_push(&shard->probation, demoted);
+	}
+    }
+    else {
+	mod_vhost_ldap_cache_queue_t *q = node->queue;
+	mod_vhost_ldap_queue_unlink(node);
+	mod_vhost_ldap_queue_push(q, node);
+    }
+
+    *dn = apr_pstrdup(p, node->dn);
+    v = apr_palloc(p, (cache->nattrs + 1) * sizeof(char *));
+    for (i = 0; i < cache->nattrs; i++)
+	v[i] = node->vals[i] ? apr_pstrdup(p, node->vals[i]) : NULL;
+    v[i] = NULL;
+    *vals = v;
+    *wildcard = node->wildcard;
+    *fallback = node->fallback;
+
+    mod_vhost_ldap_cache_unlock(shard);
+    return 1;
+}
+
+void mod_vhost_ldap_cache_touch(mod_vhost_ldap_cache_t *cache, const char *hostname, int times)
+{
+    apr_uint32_t hash = mod_vhost_ldap_cache_hash(hostname);
+    mod_vhost_ldap_cache_shard_t *shard = &cache->shards[(hash >> 24) & cache->shard_mask];
+
+    if (times > CACHE_SKETCH_MAX)
+	times = CACHE_SKETCH_MAX;
+
+    /*
+     * Not counted towards the aging sample: seeding a whole shard would
+     * otherwise halve the counters of the hostnames seeded first
+     */
+    mod_vhost_ldap_cache_lock(shard);
+    while (times-- > 0)
+	mod_vhost_ldap_sketch_add(shard, hash);
+    mod_vhost_ldap_cache_unlock(shard);
+}
+
+void mod_vhost_ldap_cache_insert(mod_vhost_ldap_cache_t *cache, const char *hostname,
+				 const char *dn, const char **vals, int wildcard, int fallback)
+{
+    apr_uint32_t hash = mod_vhost_ldap_cache_hash(hostname);
+    mod_vhost_ldap_cache_shard_t *shard = &cache->shards[(hash >> 24) & cache->shard_mask];
+    mod_vhost_ldap_cache_node_t *node, *candidate, *victim;
+    apr_size_t len;
+    char *buf;
+    int i;
+
+    /* Build the node as a single allocation: node, values array, strings */
+    len = sizeof(mod_vhost_ldap_cache_node_t) + cache->nattrs * sizeof(char *)
+	+ strlen(hostname) + 1 + strlen(dn) + 1;
+    for (i = 0; i < cache->nattrs; i++) {
+	if (vals[i])
+	    len += strlen(vals[i]) + 1;
+    }
+    if ((node = malloc(len)) == NULL)
+	return;
+
+    node->hnext = NULL;
+    node->queue = NULL;
+    node->hash = hash;
+    node->expires = apr_time_now() + cache->ttl;
+    node->wildcard = wildcard;
+    node->fallback = fallback;
+    node->vals = (char **)(node + 1);
+    buf = (char *)(node->vals + cache->nattrs);
+    node->key = strcpy(buf, hostname);
+    buf += strlen(hostname) + 1;
+    node->dn = strcpy(buf, dn);
+    buf += strlen(dn) + 1;
+    for (i = 0; i < cache->nattrs; i++) {
+	if (vals[i]) {
+	    node->vals[i] = strcpy(buf, vals[i]);
+	    buf += strlen(vals[i]) + 1;
+	}
+	else {
+	    node->vals[i] = NULL;
+	}
+    }
+
+    mod_vhost_ldap_cache_lock(shard);
+
+    /* Another thread may have resolved the same hostname meanwhile */
+    if ((victim = mod_vhost_ldap_cache_find(shard, hash, hostname)) != NULL)
+	mod_vhost_ldap_cache_remove(shard, victim);
+
+    node->hnext = shard->buckets[hash & shard->bucket_mask];
+    shard->buckets[hash & shard->bucket_mask] = node;
+    mod_vhost_ldap_queue_push(&shard->window, node);
+
+    if (shard->window.size > shard->window.capacity) {
+	/* The window LRU is a candidate for the main segment */
+	candidate = mod_vhost_ldap_queue_lru(&shard->window);
+	mod_vhost_ldap_queue_unlink(candidate);
+	mod_vhost_ldap_queue_push(&shard->probation, candidate);
+
+	if (shard->probation.size + shard->protected.size > shard->main_capacity) {
+	    victim = mod_vhost_ldap_queue_lru(&shard->probation);
+	    if (victim == candidate && shard->probation.size == 1)
+		victim = mod_vhost_ldap_queue_lru(&shard->protected);
+
+	    if (victim && victim != candidate
+		&& mod_vhost_ldap_sketch_frequency(shard, candidate->hash)
+		   > mod_vhost_ldap_sketch_frequency(shard, victim->hash)) {
+		mod_vhost_ldap_cache_remove(shard, victim);
+		shard->evicted++;
+		shard->admitted++;
+	    }
+	    else {
+		mod_vhost_ldap_cache_remove(shard, candidate);
+		shard->rejected++;
+	    }
+	}
+	else {
+	    shard->admitted++;
+	}
+    }
+
+    mod_vhost_ldap_cache_unlock(shard);
+}
+
+void mod_vhost_ldap_cache_stats(mod_vhost_ldap_cache_t *cache, mod_vhost_ldap_cache_stats_t *stats)
+{
+    apr_uint32_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i <= cache->shard_mask; i++) {
+	mod_vhost_ldap_cache_shard_t *shard = &cache->shards[i];
+
+	mod_vhost_ldap_cache_lock(shard);
+	stats->hits += shard->hits;
+	stats->misses += shard->misses;
+	stats->admitted += shard->admitted;
+	stats->rejected += shard->rejected;
+	stats->evicted += shard->evicted;
+	stats->expired += shard->expired;
+	stats->entries += shard->window.size + shard->probation.size + shard->protected.size;
+	mod_vhost_ldap_cache_unlock(shard);
+    }
+}
@@ -0,0 +1,82 @@
+/* ============================================================
+ * Copyright (c) 2003-2004, Ondrej Sury
+ * All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ */
+
+/*
+ * vhost_ldap_cache.h --- per process cache of resolved virtual hosts,
+ * sitting in front of mod_ldap.
+ *
+ * The cache is bounded and uses W-TinyLFU: new entries go to a small LRU
+ * window, and an entry leaving the window is only admitted to the main
+ * segmented LRU (probation + protected) if a count-min sketch says it has
+ * been requested more often than the entry it would evict.  Hostnames that
+ * are seen once (e.g. scans of random names) therefore never push the hot
+ * set out.  The cache is split in shards, each with its own lock, sketch
+ * and queues, to keep contention low in threaded MPMs.
+ */
+
+#ifndef VHOST_LDAP_CACHE_H
+#define VHOST_LDAP_CACHE_H
+
+#include "apr_pools.h"
+#include "apr_time.h"
+
+/* Highest popularity the cache tells apart */
+#define MOD_VHOST_LDAP_CACHE_MAX_FREQUENCY 15
+
+typedef struct mod_vhost_ldap_cache_t mod_vhost_ldap_cache_t;
+
+typedef struct mod_vhost_ldap_cache_stats_t {
+    apr_uint64_t hits;
+    apr_uint64_t misses;
+    apr_uint64_t admitted;		/* Entries moved from the window to the main segment */
+    apr_uint64_t rejected;		/* Entries dropped by the admission policy */
+    apr_uint64_t evicted;		/* Main segment entries replaced by admitted ones */
+    apr_uint64_t expired;
+    apr_uint64_t entries;		/* Entries currently cached */
+} mod_vhost_ldap_cache_stats_t;
+
+/*
+ * Create a cache holding at most entries hostnames, each with a dn and
+ * nattrs values, valid for ttl.
+ */
+mod_vhost_ldap_cache_t *mod_vhost_ldap_cache_create(apr_pool_t *p, int entries, int nattrs,
+						    apr_interval_time_t ttl);
+
+/*
+ * Look up hostname and copy the cached dn and values into pool p, along
+ * with how the entry was originally resolved.  Returns 1 on a hit, 0 on a
+ * miss.
+ */
+int mod_vhost_ldap_cache_lookup(mod_vhost_ldap_cache_t *cache, const char *hostname,
+				apr_pool_t *p, const char **dn, const char ***vals,
+				int *wildcard, int *fallback);
+
+/*
+ * Add times to hostname's estimated popularity, as if it had been looked up
+ * that often, up to MOD_VHOST_LDAP_CACHE_MAX_FREQUENCY.  Unlike lookups,
+ * this does not age the popularity of other hostnames.
+ */
+void mod_vhost_ldap_cache_touch(mod_vhost_ldap_cache_t *cache, const char *hostname, int times);
+
+/* Offer a resolved hostname to the cache; the admission policy decides */
+void mod_vhost_ldap_cache_insert(mod_vhost_ldap_cache_t *cache, const char *hostname,
+				 const char *dn, const char **vals, int wildcard, int fallback);
+
+void mod_vhost_ldap_cache_stats(mod_vhost_ldap_cache_t *cache, mod_vhost_ldap_cache_stats_t *stats);
+
+#endif /* VHOST_LDAP_CACHE_H */